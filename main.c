@@ -36,10 +36,8 @@
 #error F_CPU undefined!! Please define in Makefile
 #endif
 
-#include <avr/io.h> 
-#include <avr/pgmspace.h>
-#include <util/delay.h>
 #include "yack.h"
+#include "yackhal.h"
 
 #define PITCHREPEAT 10  // 10 e's will be played for pitch adjust
 // Some texts in Flash used by the application
@@ -54,34 +52,87 @@ void pitch (void)
  This function implements pitch change mode. A series of dots is played
  and pitch can be adjusted using the paddle levers.
  
- Once 10 dots have been played at the same pitch, the mode terminates
+ Once 10 dots have been played at the same pitch, the mode terminates.
+ The dots are keyed from here, so the paddles are free for the pitch.
  */
 {
   word timer = PITCHREPEAT;
 
   while (timer) {                      // while not yet timed out
     timer--;
-    yackchar (C_E);                    // play an 'e'
+    yackplay (DIT);                    // play an 'e'
+    yackdel (ICGLEN);
     
-    if (!(KEYINP & (1<<DITPIN))) {     // if DIT was keyed
+    if (!(halkeys () & (1<<DITPIN))) {     // if DIT was keyed
       yackpitch (UP);                // increase the pitch
       timer = PITCHREPEAT;
     }
     
-    if (!(KEYINP & (1<<DAHPIN))) {     // if DAH was keyed
+    if (!(halkeys () & (1<<DAHPIN))) {     // if DAH was keyed
       yackpitch (DOWN);                  // lower the pitch
       timer = PITCHREPEAT;
     }
   }
 }
 
+byte keydigit (void)
+/*! 
+ @brief     Reads a digit keyed with the paddle
+ 
+ Other characters are ignored.
+ 
+ @return    The digit, MAX_BYTE if none was keyed within DEFTIMEOUT seconds
+*/
+{
+  word timer = YACKSECS (DEFTIMEOUT);
+  
+  while (--timer) {  
+    byte c = yackiambic (OFF);
+    yackbeat ();
+  
+    switch (c) {
+      case C_0: return 0; 
+      case C_1: return 1; 
+      case C_2: return 2; 
+      case C_3: return 3; 
+      case C_4: return 4; 
+      case C_5: return 5; 
+      case C_6: return 6; 
+      case C_7: return 7; 
+      case C_8: return 8; 
+      case C_9: return 9; 
+    }
+  }
+  return MAX_BYTE;
+}
+
+word keynumber (void)
+/*! 
+ @brief     Reads a number keyed with the paddle
+ 
+ Digits are read until no character has been keyed for DEFTIMEOUT
+ seconds. Other characters are ignored.
+ 
+ @return    The number, 0 if none was keyed and MAX_WORD if above 9999
+*/
+{
+  word n = 0;
+  byte i;
+  
+  while ((i = keydigit ()) != MAX_BYTE)
+    n = (n > 999) ? MAX_WORD : n * 10 + i; // Five digits are too many
+  return n;
+}
+
 void beacon (byte mode)
 /*! 
  @brief     Beacon mode
  
  This routine can read a beacon transmission interval up to 9999 seconds
  and store it in EEPROM (RECORD mode) In PLAY mode, when called in the
- YACKBEAT loop, it plays back message 2 in the programmed interval
+ YACKBEAT loop, it plays back message 2 in the programmed interval. The
+ seconds are counted on the heartbeat clock, so they are kept even if
+ the main loop is held up, and in power down by the watchdog.
  
  @param mode RECORD (read and store the beacon interval) or PLAY (beacon)
 
@@ -92,68 +143,52 @@ void beacon (byte mode)
 
   static word interval = MAX_WORD; // A dummy value that can not be reached
   static word timer;
-  char i = 11;
   
   if (interval == MAX_WORD) interval = yackuser (READ, 1, 0);  
   
   if (mode == RECORD) {
-    interval = 0;                   // Reset previous settings
-    timer = YACKSECS (DEFTIMEOUT);
-  
     yackchar (C_N);
-  
-    while (--timer) {  
-      byte c = yackiambic (OFF);
-      yackbeat ();
-  
-      switch (c) {
-	case C_0: i = 0; break; 
-	case C_1: i = 1; break; 
-	case C_2: i = 2; break; 
-	case C_3: i = 3; break; 
-	case C_4: i = 4; break; 
-	case C_5: i = 5; break; 
-	case C_6: i = 6; break; 
-	case C_7: i = 7; break; 
-	case C_8: i = 8; break; 
-	case C_9: i = 9; break; 
-      }
-      if (i < 11) {
-        interval *= 10;
-        interval += i;
-        timer = YACKSECS (DEFTIMEOUT);
-      }
-    }
+    interval = keynumber ();
     
-    if (interval >= 0 && interval <= 9999) {
+    if (interval <= 9999) {
       yackuser (WRITE, 1, interval); // Record interval
       yacknumber (interval);         // Playback number
     } else {
+      interval = yackuser (READ, 1, 0); // Keep the stored one
       yackchar (C_HH);
     }
+    timer = yacktime ();            // Count seconds from now on
   }
 
   if ((mode == PLAY) && (interval > 0)) {
 
-#ifdef POWERSAVE
-
-    // If we execute this, the interval counter is positive which means
-    // we are waiting for a message playback. In this case we must not
-    // allow the CPU to enter sleep mode.
-
-    yackpower(FALSE); // Inhibit sleep mode
-#endif
-        
-    if (timer > 0)
-      timer--;             // Countdown until a second has expired
-    else {
-      timer = YACKSECS(1); // Reset timer
+    // After a power down the seconds come several at a time
+    while ((word) (yacktime () - timer) >= YACKSECS (1)) {
+      timer += YACKSECS(1);     // A second has expired
       if ((--interval) == 0) {  // Interval > 0. Did decrement bring it to 0?
         interval = yackuser (READ, 1, 0); // Reset the interval timer
+#ifdef POWERSAVE
+        yackpower (FALSE);                // Stay awake while sending
+#endif
         yackmessage (PLAY, 2);            // and play message 2
       } 
     }
   }
+
+#ifdef POWERSAVE
+  // If the interval counter is positive we are waiting for a message
+  // playback. The chip may still power down, the watchdog then wakes
+  // it up in time and keeps the seconds counted.
+
+  if (mode == PLAY) {
+    if (interval > 60)
+      yackwake (YACKSECS (60));
+    else if (interval > 0)
+      yackwake (YACKSECS (interval) - (yacktime () - timer));
+    else
+      yackwake (0);
+  }
+#endif
 }
 
 void commandmode (void) {
@@ -161,16 +196,21 @@ void commandmode (void) {
  @brief     Command mode
  
  This routine implements command mode. Entries are read from the paddle
- and interpreted as commands.
+ and interpreted as commands. A macro requested here is played after
+ leaving command mode, so the operator can break in with the paddle.
  
 */
   
   byte success = FALSE;
+  byte macro = 0;      // Macro to play on exit
+  word n;
 
   word timer;          // Exit timer
   
   byte mode = yackmode (DACTYL);
 
+  if (mode == STRAIGHT) yackmode (STRAIGHT); // Commands with the same key
+
   yackinhibit (ON);    // Sidetone = on, Keyer = off
   
   yackchar (C_R);      // Play Greeting
@@ -220,6 +260,11 @@ void commandmode (void) {
           mode = DACTYL;
           success = TRUE;
           break;
+
+        case C_G: // straight key
+          mode = STRAIGHT;
+          success = TRUE;
+          break;
                   
         case C_X: // Paddle swapping
           yacktoggle (PDLSWAP);
@@ -253,8 +298,23 @@ void commandmode (void) {
           success = TRUE;
           break;
                     
-        case C_N: // Automatic Beacon
-          beacon (RECORD);
+        case C_M: // Record the message numbered next
+          yackchar (C_M);
+          n = keydigit ();
+          if (n >= 1 && n <= MACROS) 
+            yackmessage (RECORD, n);
+          else
+            yackchar (C_HH);
+          success = TRUE;
+          break;
+                    
+        case C_F: // Farnsworth speed, 0 is off
+          yackchar (C_F);
+          n = keynumber ();
+          if (n <= MAXWPM && yackfarns (n)) 
+            yacknumber (n);
+          else
+            yackchar (C_HH);
           success = TRUE;
           break;
       }
@@ -285,18 +345,21 @@ void commandmode (void) {
         break;
                 
       case C_S: // Playback Macro 1
-        yackinhibit (OFF);
-        yackmessage (PLAY, 1);
-        yackinhibit (ON);
-        timer = YACKSECS (MACTIMEOUT);
+        macro = 1;
         success = TRUE;
         break;
                 
       case C_U: // Playback Macro 2
-        yackinhibit (OFF);
-        yackmessage (PLAY, 2);
-        yackinhibit (ON);
-        timer = YACKSECS (MACTIMEOUT);
+        macro = 2;
+        success = TRUE;
+        break;
+                
+      case C_P: // Playback the message numbered next
+        n = keydigit ();
+        if (n >= 1 && n <= MACROS) 
+          macro = n;
+        else
+          yackchar (C_HH);
         success = TRUE;
         break;
                 
@@ -309,6 +372,23 @@ void commandmode (void) {
         yacknumber (yackwpm ());
         success = TRUE;
         break;
+
+#ifdef STATS
+      case C_C: // Counters of the hot path
+        for (n = 0; n < NSTATS; n++) {
+          if (n) yackdel (IWGLEN);
+          yacknumber (yackstat (n));
+        }
+        success = TRUE;
+        break;
+#endif
+
+#ifdef STACKCHECK
+      case C_H: // Stack margin
+        yacknumber (yackstack ());
+        success = TRUE;
+        break;
+#endif
     }
         
     if (success) {
@@ -323,6 +403,7 @@ void commandmode (void) {
   if (mode != yackmode (mode)) yacksave ();
   yackchar (PRGX);        // Sign off
   yackinhibit (OFF);      // Back to normal mode
+  if (macro) yackmessage (PLAY, macro);
 }
 
 int main (void) 
@@ -330,7 +411,8 @@ int main (void)
  @brief     Trivial main routine
  
  Yack library is initialized, command mode is entered on request and
- both beacon and keyer routines are called in 10 ms intervals.
+ the beacon is served once per heartbeat. The keyer itself runs in the
+ heartbeat interrupt, here we only pick up what it decoded.
  
  @return Not relevant
 */
@@ -344,7 +426,7 @@ int main (void)
   while (TRUE) {            // Endless core loop of the keyer app
     // If command key pressed, go to command mode
     if (yackctrlkey (TRUE)) commandmode ();
-    yackbeat ();
+    yackidle ();            // The heartbeat slows down when idle
     beacon (PLAY);          // Play beacon if requested
     yackiambic (OFF);
   }
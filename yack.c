@@ -29,18 +29,97 @@ Some of the first generation keyers exhibited this behaviur so the chip can simu
 
 */ 
 
-#include <avr/io.h> 
-#include <avr/pgmspace.h>
-#include <avr/eeprom.h>
-#include <avr/interrupt.h>
-#include <avr/sleep.h>
-#include <util/delay.h>
-#include <stdint.h>
+#include <string.h>
 #include "yack.h"
+#include "yackhal.h"
+
+// A build for a single keyer mode (ONLYMODE, see yack.h) leaves out
+// the decision routines of the other modes
+#ifdef ONLYMODE
+#define MODEIN(a, b) (ONLYMODE == (a) || ONLYMODE == (b))
+#else
+#define MODEIN(a, b) 1
+#endif
 
 // Forward declaration of private functions
 static      void yackkey (byte mode); 
-static      void keylatch (byte lastkey);
+static      void keylatch (byte lastkey, word cutoff);
+static      byte keybits (byte pins);
+static      void opinit (void);
+static      void optrack (byte i, word len);
+static      word opcut (byte i);
+static      void setmode (void);
+#if MODEIN (IAMBA, IAMBA)
+static      byte iambica (byte key, byte lastkey, byte last);
+#endif
+#if MODEIN (IAMBB, IAMBB)
+static      byte iambicb (byte key, byte lastkey, byte last);
+#endif
+#if MODEIN (ULTIM, ULTIM)
+static      byte ultimatic (byte key, byte lastkey, byte last);
+#endif
+#if MODEIN (DITPR, STRAIGHT)
+static      byte ditfirst (byte key, byte lastkey, byte last);
+#endif
+#if MODEIN (DAHPR, DAHPR)
+static      byte dahfirst (byte key, byte lastkey, byte last);
+#endif
+#if MODEIN (DACTYL, DACTYL)
+static      byte dactylic (byte key, byte lastkey, byte last);
+#endif
+#if MODEIN (STRAIGHT, STRAIGHT)
+static      void skedge (word t, byte closed);
+#if (NFIB == 13)
+static      byte skfsm (byte ctrl);
+#else
+static      word skfsm (byte ctrl);
+#endif
+#endif
+static      void txclear (void);
+static      void keyresume (void);
+static      void keyidle (void);
+static      void ckfsm (void);
+#ifdef SERIAL
+static      void serialbits (word t);
+static      void serialedge (word t, byte level);
+#endif
+#ifdef TELEMETRY
+static      void telpush (word space, word mark);
+static      void telcount (word n);
+static      void telnumber (word n);
+static      void telformat (void);
+#endif
+static      void beatfast (void);
+static      void beatwait (byte mayslow);
+static      void setpace (void);
+static      word pace (byte n, byte spc);
+static      void eeput (byte *p, byte v);
+static      void eeputw (word *p, word v);
+static      void eesync (void);
+static      byte crc8 (const byte *p, byte n);
+static      byte journalload (void);
+static      byte eeget (const byte *p);
+static      void bitseek (word pos);
+static      byte bitget (byte n);
+static      void bitopen (word pos);
+static      void bitput (byte v, byte n);
+static      void bitflush (void);
+static      byte symget (void);
+static      byte symput (byte c, byte reserve);
+static      void macroopen (void);
+static      byte macroput (byte c);
+static      byte wordfind (byte n, byte whole);
+static      byte wordend (void);
+static      void macroclose (void);
+static      void wordplay (byte s);
+static      word macrostart (byte nr);
+static      word macroend (void);
+static      word macrodrop (byte nr);
+#if (NFIB == 13)
+static      byte keyfsm (byte ctrl);
+#else
+static      word keyfsm (byte ctrl);
+#endif
 
 // Enumerations
 
@@ -50,28 +129,348 @@ enum FSMSTATE {
   S_IDLE   //!< Idle, waiting for the first element of the next symbol
 };   
 
+// The keyer modes differ only in which element follows when the FSM
+// decides on the latches. Each mode has its own routine for that,
+// picked from a table in flash when the mode changes. A single mode
+// build calls its routine directly.
+
+typedef byte (*DECISION) (byte key, byte lastkey, byte last);
+
+#ifdef ONLYMODE
+#if (ONLYMODE == IAMBA)
+#define decide iambica
+#elif (ONLYMODE == IAMBB)
+#define decide iambicb
+#elif (ONLYMODE == ULTIM)
+#define decide ultimatic
+#elif (ONLYMODE == DITPR) || (ONLYMODE == STRAIGHT)
+#define decide ditfirst
+#elif (ONLYMODE == DAHPR)
+#define decide dahfirst
+#elif (ONLYMODE == DACTYL)
+#define decide dactylic
+#else
+#error "ONLYMODE must be one of the keyer modes"
+#endif
+#else
+static const DECISION decisions[8] PROGMEM = {
+  iambica,      // IAMBA
+  iambicb,      // IAMBB
+  ultimatic,    // ULTIM
+  ditfirst,     // Not used
+  ditfirst,     // DITPR
+  dahfirst,     // DAHPR
+  ditfirst,     // STRAIGHT, not called
+  dactylic      // DACTYL
+};
+#endif
+
 // The FSM state also includes a time, counting down. When reaching zero
-// the FSM determines the next state. Also, volflags is included here.
+// the FSM determines the next state. Also, the paddle latches are
+// included here.
+
+// The FSM runs in the heartbeat interrupt. Variables shared between the
+// interrupt and the foreground are volatile, and multi-byte ones are
+// only accessed with interrupts disabled.
 
 // Module local definitions
 
 static byte yackflags;        // Permanent (stored) status of module flags
-static byte volflags = 0;     // Temporary working flags (volatile)
+static volatile byte volflags = 0; // Temporary working flags (volatile)
 static word ctcvalue;         // Pitch
-static word wpmcnt;           // Speed
+static word wpmcnt;           // Speed, whole beats per dot
+static byte wpmrem;           // and the remainder in 1/wpm beats
 static byte wpm;              // Real wpm
+static byte farns;            // Farnsworth speed, 0 if off
+static word spccnt;           // Whole beats per spacing unit
+static word spcrem;           // and the remainder
+static word spcdiv;           // in 1/spcdiv beats
+
+static byte latches = 0;      // DITLATCH and DAHLATCH, owned by the FSM
+#ifndef ONLYMODE
+static DECISION volatile decide = dactylic; // Decision routine of the mode
+#endif
+static volatile word beats = 0;    // Heartbeat counter
+static volatile word tickbase = 0; // Timestamp of the last heartbeat
+static volatile byte slow = FALSE; // Heartbeat slowed down to 2^SLOWBEAT ms
+static volatile byte slowok = FALSE; // Set while the foreground allows it
+static volatile byte fsmctrl = OFF; // Word end recognition for the FSM
+#if (NFIB == 13)
+static volatile byte rxchar = 0;   // Last character decoded by the FSM
+#else
+static volatile word rxchar = 0;
+#endif
+#ifdef STATS
+static volatile word stats[NSTATS]; // Hot path counters, see yack.h
+static word lastclose;        // Time of the last accepted contact closure
+#define STATINC(n) do { if (stats[n] != MAX_WORD) stats[n]++; } while (0)
+#endif
+#ifdef POWERSAVE
+static volatile byte powerreq = FALSE; // Set by the FSM when idle long enough
+static volatile byte unattended = FALSE; // No pin change since powering down
+static word wdtms = 0;                 // Watchdog period while powered down
+#endif
+
+// Paddle edges captured by the pin change interrupt. Timestamps are in
+// timer1 counts (BEATCNT per beat) and wrap around after about half a
+// second, so they are only compared over short distances. A slow
+// heartbeat period counts as SLOWGAP, longer than any of those. The queue
+// has a single producer (pin change interrupt) and a single consumer
+// (the FSM in the heartbeat interrupt), each owning one index.
+
+#define EDGEQ 8                    // Queue size, a power of two
+#define SLOWGAP 0x4000             // Timestamp step over a slow period
+
+static word edgetime[EDGEQ];       // Timestamp of the edge
+static byte edgepins[EDGEQ];       // Port levels after the edge
+static volatile byte edgehead = 0; // Next entry to write
+static volatile byte edgetail = 0; // Next entry to read
+static volatile byte edgelost = TRUE; // Queue overflowed, re-read the port
+
+#ifdef SERIAL
+
+// Serial input for keyboard sending. The pin change interrupt
+// timestamps the edges of the RX line like those of the paddles, and
+// each bit of a frame gets the level the line had at its middle. Bits
+// after the last edge of a frame are sampled by the heartbeat. The
+// characters received wait in serq until the FSM sends them, after
+// those queued by yackchar.
+
+#define SERQ    32                 // Type-ahead buffer, a power of two
+#define SERIDLE 10                 // serbit while no frame is received
+
+static volatile byte serq[SERQ];   // Character codes received
+static volatile byte serhead = 0;  // Next entry to write (interrupts)
+static volatile byte sertail = 0;  // Next entry to read (FSM)
+static word serstart;              // Timestamp of the start bit
+static byte serbit = SERIDLE;      // Next bit to sample, 0 is the start bit
+static byte serdata;               // Data bits sampled so far
+static byte serlevel = TRUE;       // RX level since the last edge
+static byte pcpins = 0xff;         // Port levels at the last pin change
+
+#define SERIALIDLE (serbit == SERIDLE && serhead == sertail)
+#else
+#define SERIALIDLE TRUE
+#endif
+
+#ifdef TELEMETRY
+
+// Telemetry of the paddle keying. The FSM records each element it keys
+// for the paddle together with the space before it, and each character
+// it decodes. The foreground turns the records into text in yackbeat
+// and the compare B interrupt sends the text bit by bit, so neither the
+// heartbeat nor the foreground waits for the line.
+
+#define TELQ     4                 // Records, a power of two
+#define TELOUT  16                 // Text waiting to be sent, a power of two
+#define TELNEXT 10                 // telbit when the next byte is due
+#define TELOFF  11                 // telbit while the bit clock is stopped
+
+static word telspace[TELQ];        // Space before the element in beats,
+                                   // or the character code
+static word telmark[TELQ];         // Length of the element in beats, 0
+                                   // for a character
+static volatile byte telhead = 0;  // Next record to write (FSM)
+static volatile byte teltail = 0;  // Next record to read (foreground)
+static word telspc = MAX_WORD;     // Beats since the key went up (FSM)
+static byte telout[TELOUT];        // Text to send
+static volatile byte telouthead = 0; // Next byte to write (foreground)
+static volatile byte telouttail = 0; // Next byte to send (interrupt)
+static volatile byte telbit = TELOFF; // Next bit to send, 0 is the start bit
+static byte telbyte;               // Bits of the byte not sent yet
+
+#define TELIDLE (telbit == TELOFF && telhead == teltail \
+                 && telouthead == telouttail)
+#else
+#define TELIDLE TRUE
+#endif
+
+// Characters queued for sending. yackchar puts them in, the FSM takes
+// them out and keys them element by element, the same way it keys the
+// paddle. The character being sent is kept as a sequence of elements,
+// first element in bit 0, a set bit is a dah.
+
+#define TXQ 8                      // Queue size, a power of two
+
+static volatile byte txqueue[TXQ]; // Fibonacci coded characters
+static volatile byte txhead = 0;   // Next entry to write (foreground)
+static volatile byte txtail = 0;   // Next entry to read (FSM)
+static word txbits = 0;            // Elements left of the current character,
+                                   // followed by a 1 bit
+static volatile byte txactive = FALSE; // Set while queued output is sent
+static volatile byte txbreak = FALSE;  // Set when the paddle broke in
+static volatile byte keying = FALSE;   // Set while the FSM keys an element
+static volatile byte txresume = FALSE; // Set while yackinhibit waits to
+                                       // key the transmitter again
+
+// Operator timing. The decoders follow what the operator actually
+// keys, with running averages in beats (OPFRAC fraction bits) of the
+// straight key dit and the gaps between characters and words, and of
+// the paddle pauses that ended a word. A threshold lies halfway between
+// neighbouring averages. The gap within a character is taken as long
+// as the dit, so the marks hold the shortest gap in place and the
+// others cannot drift into it. The paddle pauses are counted from the
+// end of the character gap, and shorter ones stay at their nominal 0.
+
+#define OPFRAC   2                 // Fraction bits of the averages
+
+#define OP_DIT   0                 // Straight key dit and gap within a character
+#define OP_CHAR  1                 // Straight key gap between characters
+#define OP_WORD  2                 // and between words
+#define OP_PCHAR 3                 // Paddle pause within a word
+#define OP_PWORD 4                 // and between words
+#define OPN      5
+
+static const byte opnom[OPN] = {1, 3, 7, 0, IWGLEN}; // Nominal, in dots
+static word opavg[OPN];            // Averages, owned by the FSM
+#ifdef HOST
+static byte oplearn = TRUE;        // The averages follow the operator
+#endif
+
+// A straight key on the dit contact (mode STRAIGHT) keys the transmitter
+// from the pin change interrupt. A change is taken DEBOUNCE after the
+// previous one at the earliest. The heartbeat brings the key in line
+// with the contact once that has passed, and decodes the marks and
+// spaces. The paddle FSM only sends the queued output meanwhile, the
+// contacts never reach its latches. While the button or the foreground
+// holds the key, the straight key is taken as open, so it is read from
+// the port again when they let go.
+
+#if MODEIN (STRAIGHT, STRAIGHT)
+static volatile byte skdown = FALSE; // Straight key closed, TX keyed
+static word sktime;                  // Its last change, in timer1 counts
+static word skstart;                 // Beats at the closure
+static volatile word skmark = 0;     // Last mark in beats, 0 when decoded
+static volatile byte skbusy = FALSE; // Key closed or a word not ended yet
+
+#define SKDOWN skdown
+#define SKIDLE (!skbusy)
+#else
+#define SKDOWN FALSE
+#define SKIDLE TRUE
+#endif
+
+// The command button is debounced in the heartbeat interrupt. While it
+// is held the keyer FSM is paused and the paddles change the speed.
+
+static volatile byte ckdown = FALSE; // Debounced button state
+static byte ckbounce = 0;          // Beats the button differed from it
+static word ckheld;                // Beats held so far
+static word ckstep;                // Beats to the next speed step
+static byte ckspeed;               // A paddle was used during the press
+static volatile byte ckstepped = FALSE; // Speed changed, not played yet
+static volatile byte ckevent = 0;  // CKCLICK or CKHOLD, not handled yet
+
+// EEPROM writes waiting for the EEPROM ready interrupt. Each takes
+// about 3.4 ms, so they are written behind while the keyer goes on.
+// The foreground puts them in, the interrupt takes them out.
+
+#define EEQ 8                      // Queue size, a power of two
+
+static byte * volatile eeaddr[EEQ]; // EEPROM address
+static volatile byte eedata[EEQ];  // and the byte to write there
+static volatile byte eehead = 0;   // Next entry to write (foreground)
+static volatile byte eetail = 0;   // Next entry to read (interrupt)
+static volatile byte eebusy = FALSE; // Set while writes are pending
 
 // EEPROM Data
 
-byte magic EEMEM = MAGPAT;    // Needs to contain 'A5' if mem is valid
-byte flagstor EEMEM = (IAMBA | TXKEY | SIDETONE);  //  Defaults  
-word ctcstor EEMEM = DEFCTC;  // Pitch = 800Hz
-byte wpmstor EEMEM = DEFWPM;  // 15 WPM
+// The settings are kept in a journal of JSLOTS records. Each save
+// appends a record in the slot after the newest one, so the writes are
+// spread over all slots. A record carries a sequence number and a
+// CRC. At boot the valid record with the highest sequence number wins,
+// so a record torn by a brown-out falls back to the previous one.
+
+#define J_SEQ     0           // Sequence number, wrapping
+#define J_FLAGS   1           // yackflags
+#define J_CTCL    2           // ctcvalue, low byte
+#define J_CTCH    3           // and high byte
+#define J_WPM     4           // wpm
+#define J_FARNS   5           // farns
+#define J_CRC     6           // CRC-8 of the bytes above, written last
+#define JRECLEN   7
+
+byte journal[JSLOTS][JRECLEN] EEMEM; // No valid record, defaults are used
+static byte jslot = JSLOTS-1; // Slot of the newest record
+static byte jseq = 0;         // and its sequence number
 word user1 EEMEM = 0;         // User storage
 word user2 EEMEM = 0;         // User storage
 
-byte eebuffer1[100] EEMEM = {C_M, C_E, C_S, C_S, C_A, C_G, C_E, C_SPACE, C_1, 0};
-byte eebuffer2[100] EEMEM = {C_M, C_E, C_S, C_S, C_A, C_G, C_E, C_SPACE, C_2, 0};
+// The messages (macros) share one EEPROM area, packed into a stream of
+// bits, most significant bit of each byte first. A message is its
+// characters in a prefix code followed by the M_END symbol. The
+// messages follow each other without gaps, in the order they were
+// recorded. The directory eedir holds the bit position at which each
+// message starts, MAX_WORD if there is none, so a message is found
+// without reading the ones before it.
+//
+// The code is canonical: symcount holds the number of symbols of each
+// length from 1 to 8 bits and symbols the symbols, shortest first. The
+// lengths follow the frequencies in contest and QSO macros. Some words
+// of those have a symbol of their own, listed in dict, and a word the
+// same as the one before it is stored as M_REP. Other characters are
+// escaped and stored in 8 bits. Codes from M_WORD up are not stored,
+// no character the keyer decodes has one.
+
+#define MACROBITS (MACROSIZE * 8)
+
+#define M_END     0    // End of the message
+#define M_WORD    240  // First word of dict
+#define M_REP     254  // The previous word again
+#define M_ESC     255  // Followed by a character in 8 bits
+#define M_RESERVE 4    // Bits kept for M_END
+#define WORDLEN   8    // Longest word held back while encoding
+#define DICTWORDS 12   // Words in dict
+
+#define M_CQ   (M_WORD+0)
+#define M_DE   (M_WORD+1)
+#define M_TEST (M_WORD+2)
+#define M_5NN  (M_WORD+3)
+#define M_TU   (M_WORD+4)
+#define M_73   (M_WORD+5)
+#define M_QRZ  (M_WORD+6)
+#define M_QSO  (M_WORD+7)
+#define M_RST  (M_WORD+8)
+#define M_TNX  (M_WORD+9)
+#define M_PSE  (M_WORD+10)
+#define M_AGN  (M_WORD+11)
+
+static const byte dict[] PROGMEM = {
+  C_C, C_Q, 0,  C_D, C_E, 0,  C_T, C_E, C_S, C_T, 0,  C_5, C_N, C_N, 0,
+  C_T, C_U, 0,  C_7, C_3, 0,  C_Q, C_R, C_Z, 0,  C_Q, C_S, C_O, 0,
+  C_R, C_S, C_T, 0,  C_T, C_N, C_X, 0,  C_P, C_S, C_E, 0,  C_A, C_G, C_N, 0};
+
+static const byte symcount[8] PROGMEM = {0, 1, 0, 1, 9, 16, 13, 14};
+
+static const byte symbols[] PROGMEM = {
+  C_SPACE,
+  M_END,
+  M_REP, C_L, C_5, C_M, C_K, C_A, C_E, C_R, C_S,
+  M_DE, M_TU, M_5NN, C_QUEST, C_9, C_Q, C_G, C_N,
+  C_T, C_H, C_U, C_I, C_1, C_C, C_D, C_O,
+  C_Z, C_7, C_P, M_PSE, M_TNX, C_X, C_F, M_TEST, M_73, C_4, C_B, C_W, M_CQ,
+  M_QRZ, C_J, C_2, C_3, C_6, C_SLASH, M_AGN, C_8, C_Y, C_V, C_0, M_QSO,
+  M_RST, M_ESC};
+
+// "MESSAGE 1" and "MESSAGE 2" in the above code
+byte eemacro[MACROSIZE] EEMEM = {
+  0x6c, 0x25, 0x27, 0xd9, 0x03, 0x24,
+  0x6c, 0x25, 0x27, 0xd9, 0x03, 0xd1};
+
+word eedir[MACROS] EEMEM = {0, 48, MAX_WORD, MAX_WORD, MAX_WORD,
+  MAX_WORD, MAX_WORD, MAX_WORD, MAX_WORD};
+
+static word rpos;              // Read position in the stream
+static byte rbyte;             // and the byte it is in
+static word wpos;              // Write position in the stream
+static byte wbyte;             // and the bits of its byte so far
+
+static byte mword[WORDLEN];    // Word being recorded
+static byte mlen;              // Its length so far
+static byte mprev;             // Length of the previous word, 0 if none
+static byte msame;             // TRUE while it equals the previous word
+static byte mhold;             // TRUE while it is held back
+static byte mspace;            // A space is due before the next word
 
 // Fibonacci series used for coding Morse symbols
 // f[0) = f[1] = 1, f[2] = 2, f[3] = 3, f[n] = f[n-1] + f[n-2]  
@@ -85,6 +484,49 @@ const word f[NFIB] = {1, 1, 2, 3, 5, 8, 13, 21, 34, 55, 89, 144, 233, 377,
 	  610, 987, 1597, 2584, 4181, 6765, 10946, 17711, 28657, 46368};
 #endif
 
+// Character codes of ASCII 32 to 95, 0 where Morse has none
+
+static const byte asciicode[64] PROGMEM = {
+  C_SPACE, 0, 0, 0, 0, 0, C_AS, 0,                     //  !"#$%&'
+  0, 0, 0, C_PLUS, 0, 0, C_DOT, C_SLASH,               // ()*+,-./
+  C_0, C_1, C_2, C_3, C_4, C_5, C_6, C_7,              // 01234567
+  C_8, C_9, 0, 0, 0, 0, 0, C_QUEST,                    // 89:;<=>?
+  0, C_A, C_B, C_C, C_D, C_E, C_F, C_G,                // @ABCDEFG
+  C_H, C_I, C_J, C_K, C_L, C_M, C_N, C_O,              // HIJKLMNO
+  C_P, C_Q, C_R, C_S, C_T, C_U, C_V, C_W,              // PQRSTUVW
+  C_X, C_Y, C_Z, 0, 0, 0, 0, 0};                       // XYZ[\]^_
+
+// The elements of each character code, as returned by yackelements, for
+// the codes of up to 7 elements. 0 marks a code with more, those are
+// taken apart using f. So are the codes from f[12] up, which depend on
+// NFIB. Queued characters are bytes also when NFIB is 24, so the table
+// covers all codes that can be sent.
+
+static const byte fibels[256] PROGMEM = {
+  0x01, 0x01, 0x02, 0x04, 0x03, 0x08, 0x05, 0x06, 0x10, 0x09, 0x0a, 0x0c,
+  0x07, 0x20, 0x11, 0x12, 0x14, 0x0b, 0x18, 0x0d, 0x0e, 0x40, 0x21, 0x22,
+  0x24, 0x13, 0x28, 0x15, 0x16, 0x30, 0x19, 0x1a, 0x1c, 0x0f, 0x80, 0x41,
+  0x42, 0x44, 0x23, 0x48, 0x25, 0x26, 0x50, 0x29, 0x2a, 0x2c, 0x17, 0x60,
+  0x31, 0x32, 0x34, 0x1b, 0x38, 0x1d, 0x1e, 0x00, 0x81, 0x82, 0x84, 0x43,
+  0x88, 0x45, 0x46, 0x90, 0x49, 0x4a, 0x4c, 0x27, 0xa0, 0x51, 0x52, 0x54,
+  0x2b, 0x58, 0x2d, 0x2e, 0xc0, 0x61, 0x62, 0x64, 0x33, 0x68, 0x35, 0x36,
+  0x70, 0x39, 0x3a, 0x3c, 0x1f, 0x00, 0x00, 0x00, 0x00, 0x83, 0x00, 0x85,
+  0x86, 0x00, 0x89, 0x8a, 0x8c, 0x47, 0x00, 0x91, 0x92, 0x94, 0x4b, 0x98,
+  0x4d, 0x4e, 0x00, 0xa1, 0xa2, 0xa4, 0x53, 0xa8, 0x55, 0x56, 0xb0, 0x59,
+  0x5a, 0x5c, 0x2f, 0x00, 0xc1, 0xc2, 0xc4, 0x63, 0xc8, 0x65, 0x66, 0xd0,
+  0x69, 0x6a, 0x6c, 0x37, 0xe0, 0x71, 0x72, 0x74, 0x3b, 0x78, 0x3d, 0x3e,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x87, 0x00, 0x00, 0x00, 0x00, 0x8b, 0x00, 0x8d, 0x8e, 0x00, 0x00, 0x00,
+  0x00, 0x93, 0x00, 0x95, 0x96, 0x00, 0x99, 0x9a, 0x9c, 0x4f, 0x00, 0x00,
+  0x00, 0x00, 0xa3, 0x00, 0xa5, 0xa6, 0x00, 0xa9, 0xaa, 0xac, 0x57, 0x00,
+  0xb1, 0xb2, 0xb4, 0x5b, 0xb8, 0x5d, 0x5e, 0x00, 0x00, 0x00, 0x00, 0xc3,
+  0x00, 0xc5, 0xc6, 0x00, 0xc9, 0xca, 0xcc, 0x67, 0x00, 0xd1, 0xd2, 0xd4,
+  0x6b, 0xd8, 0x6d, 0x6e, 0x00, 0xe1, 0xe2, 0xe4, 0x73, 0xe8, 0x75, 0x76,
+  0xf0, 0x79, 0x7a, 0x7c, 0x3f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00
+};
+
 // Example
 // SK ···-·- 
 //           (c, i) =  (1, 0)
@@ -254,10 +696,14 @@ void yackreset (void)
 */
 {
 
-  ctcvalue  = DEFCTC;                  // Initialize to 800 Hz
-  wpm       = DEFWPM;                  // Init to default speed
-  wpmcnt    = (12000/YACKBEAT)/DEFWPM; // default speed
-  yackflags = FLAGDEFAULT;  
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    ctcvalue  = DEFCTC;                  // Initialize to 800 Hz
+    wpm       = DEFWPM;                  // Init to default speed
+    farns     = 0;                       // No Farnsworth spacing
+    yackflags = FLAGDEFAULT;  
+  }
+  setpace ();
+  setmode ();
 
   volflags |= DIRTYFLAG;
   yacksave ();                         // Store them in EEPROM
@@ -271,62 +717,308 @@ void yackinit (void) {
  
  This function initializes the keyer hardware according to the
  configurations in the .h file. Then it attempts to read saved
- configuration settings from EEPROM. If not possible, it will reset all
- values to their defaults. This function must be called once before the
- remaining fuctions can be used.
+ configuration settings from the EEPROM journal. If not possible, it
+ will reset all values to their defaults. This function must be called
+ once before the remaining fuctions can be used.
 
 */
-  // Configure DDR. Make OUT and ST output ports
-  SETBIT (OUTDDR,  OUTPIN);    
-  SETBIT (STDDR,   STPIN);
-  
-  // Raise internal pullups for all inputs
-  SETBIT (KEYPORT, DITPIN);  
-  SETBIT (KEYPORT, DAHPIN);
-  SETBIT (BTNPORT, BTNPIN);
-  
-  byte magval = eeprom_read_byte (&magic);    // Retrieve magic value
+  halinit ();                                 // Configure ports and pullups
   
-  if (magval == MAGPAT) {                     // Is memory valid
-    ctcvalue = eeprom_read_word (&ctcstor);   // Retrieve last ctc setting
-    wpm = eeprom_read_byte (&wpmstor);        // Retrieve last wpm setting
-    wpmcnt = (12000/YACKBEAT)/wpm;            // Calculate speed
-    yackflags = eeprom_read_byte (&flagstor); // Retrieve last flags  
-  } else {
+  if (journalload ()) {                       // Newest valid settings
+    setpace ();                               // Calculate speed
+    setmode ();                               // and decision routine
+  } else
     yackreset ();
-  }  
   
   yackinhibit (OFF);
 
+  haltimer ();   // Pin change wake-up and 1 ms heartbeat interrupt
+    
+}
+
+HALISR (TIMER1_COMPA_vect)
+/*! 
+ @brief     Heartbeat interrupt
+ 
+ Called every YACKBEAT by the timer1 compare match. It advances the
+ heartbeat counter, debounces the command button and runs the keyer
+ FSM, so that keying does not depend on how busy the foreground is.
+ The FSM is skipped while the foreground keys the transmitter itself
+ (playback, tuning, speed feedback), as flagged by FGKEY, and while
+ the command button is held.
+ 
+ While the heartbeat is slowed down there is nothing to do for the
+ FSM, only the time is counted.
+ 
+ */
+{
+#if (NFIB == 13)
+  byte c;
+#else
+  word c;
+#endif
+
+  if (slow) {
+    beats += 1 << SLOWBEAT;
+#ifdef TELEMETRY
+    telcount (1 << SLOWBEAT);
+#endif
 #ifdef POWERSAVE
-    PCMSK |= PWRWAKE;      // Define which keys wake us up
-    GIMSK |= (1 << PCIE);  // Enable pin change interrupt
+    yackpower (TRUE);
+#endif
+    return;
+  }
+
+  beats++;
+  tickbase += BEATCNT;
+  
+#ifdef SERIAL
+  serialbits (tickbase);        // Bits after the last edge of a frame
+#endif
+
+  ckfsm ();
+
+  if (!(volflags & FGKEY) && !ckdown) {
+    c = keyfsm (fsmctrl);
+#if MODEIN (STRAIGHT, STRAIGHT)
+    if ((yackflags & MODE) == STRAIGHT) c = skfsm (fsmctrl);
+#endif
+    if (c) rxchar = c;          // Picked up by yackiambic
+  } else {
+    edgetail = edgehead;        // Paddles are ignored meanwhile
+    edgelost = TRUE;
+#if MODEIN (STRAIGHT, STRAIGHT)
+    skdown = FALSE;             // Read from the port again afterwards
+#endif
+  }
+
+#ifdef STATS
+  if (halbeatlate ()) {
+    STATINC (ST_OVERRUN);
+  } else {
+    word cyc = halsubbeat () * CNTCYC;
+    if (cyc > stats[ST_BEATCYC]) stats[ST_BEATCYC] = cyc;
+  }
 #endif
-    
-    // Initialize timer1 to serve as the system heartbeat. CK runs at 1
-    // MHz. Prescaling by 8 makes that 125 kHz. Counting 125 cycles of
-    // that generates an overflow every 1.0 ms
-    
-    OCR1C = 124; // 125 counts per cycle
-    TCCR1 |= (1 << CTC1) | 0b00000100; // Clear Timer on match, prescale ck by 8
-    OCR1A = 1; // CTC mode does not create an overflow so we use OCR1A
-    
 }
 
+HALISR (PCINT0_vect)
+/*! 
+ @brief     Captures the paddle edges
+ 
+ This function is called whenever there is a level change on one of
+ the contacts we are monitoring (Dit, Dah and, for waking up from
+ power down, the command key). The port levels are queued together with
+ the time of the edge, which is the heartbeat time plus the timer1
+ count. The FSM picks them up in the next heartbeat. If the queue is
+ full the edge is dropped and the FSM re-reads the port instead.
+ 
+ Edges of the serial input go to the serial receiver instead, except
+ while the telemetry drives the line.
+
+ An edge ends a slow heartbeat, it is timestamped on the 1 ms one. Any
+ pin change counts as activity, so a pending power down is cancelled.
+
+ */
+{
+  byte head = edgehead;
+  byte next = (head + 1) & (EDGEQ - 1);
+  word t;
+  byte pins;
+
 #ifdef POWERSAVE
+  unattended = FALSE;
+  powerreq = FALSE;
+#endif
+  beatfast ();
+  t = tickbase + halsubbeat ();
+  pins = halkeys ();
+
+#ifdef SERIAL
+  byte change = pins ^ pcpins;
+
+  pcpins = pins;
+#ifdef TELEMETRY
+  if (telbit != TELOFF) change &= ~(1 << RXPIN);  // Our own output
+#endif
+  if (change & (1 << RXPIN)) serialedge (t, (pins & (1 << RXPIN)) != 0);
+  if (!(change & ~(1 << RXPIN))) return;  // Only the serial input
+#endif
+
+#if MODEIN (STRAIGHT, STRAIGHT)
+  if ((yackflags & MODE) == STRAIGHT) {
+    if (!(volflags & FGKEY) && !ckdown)
+      skedge (t, keybits (pins) & DITLATCH);
+    return;                     // Not for the paddle FSM
+  }
+#endif
+
+  if (next == edgetail) {
+    edgelost = TRUE;
+  } else {
+    edgetime[head] = t;
+    edgepins[head] = pins;
+    edgehead = next;
+  }
+}
+
+#ifdef TELEMETRY
+HALISR (TIMER1_COMPB_vect)
+/*! 
+ @brief     Sends the telemetry text, one bit per compare match
+ 
+ The bits are BITCNT timer1 counts apart, counted from match to match,
+ so an interrupt serviced late delays a single edge but not the ones
+ after it. When the text is sent the bit clock stops itself.
+ 
+ */
+{
+  if (telbit == TELNEXT) {
+    if (telouttail == telouthead) {
+      halbitstop ();
+      telbit = TELOFF;
+      return;
+    }
+    telbyte = telout[telouttail];
+    telouttail = (telouttail + 1) & (TELOUT - 1);
+    telbit = 0;
+  }
+
+  if (telbit == 0) {
+    halserout (0);                  // Start bit
+  } else if (telbit < 9) {
+    halserout (telbyte & 1);        // Least significant bit first
+    telbyte >>= 1;
+  } else {
+    halserout (1);                  // Stop bit
+  }
+  telbit++;
+  halbitnext ();
+}
+#endif
+
+HALISR (EE_RDY_vect)
+/*! 
+ @brief     Writes the next queued byte to EEPROM
+ 
+ Called as long as the EEPROM is ready and the interrupt is enabled.
+ Bytes that already hold the value are skipped, which saves both time
+ and write cycles. When the queue is empty the interrupt disables
+ itself.
+ 
+ */
+{
+  byte tail = eetail;
+
+  while (tail != eehead) {
+    byte *p = eeaddr[tail];
+    byte v  = eedata[tail];
+
+    tail = (tail + 1) & (EEQ - 1);
+    if (haleeread (p) != v) {
+      haleestart (p, v);
+#ifdef STATS
+      STATINC (ST_EEWRITE);
+#endif
+      eetail = tail;
+      return;
+    }
+  }
+  eetail = tail;
+  haleeirq (OFF);
+  eebusy = FALSE;
+}
+
+static void eeput (byte *p, byte v)
+/*! 
+ @brief     Queues a byte to be written to EEPROM
+ 
+ Returns at once unless the queue is full, in which case it waits for
+ room. The heartbeat and the keyer go on meanwhile.
+ 
+ This is a private function.
+ 
+ @param p   EEPROM address
+ @param v   Value to write
+ */
+{
+  byte head = eehead;
+  byte next = (head + 1) & (EEQ - 1);
+
+  while (next == eetail) yackbeat ();  // Wait for room
+
+  eeaddr[head] = p;
+  eedata[head] = v;
+  eehead = next;
+  
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    eebusy = TRUE;
+    haleeirq (ON);        // Fires at once if the EEPROM is idle
+  }
+}
+
+static void eeputw (word *p, word v)
+/*! 
+ @brief     Queues a word to be written to EEPROM, low byte first
+ 
+ This is a private function.
+ */
+{
+  eeput ((byte *) p, v & 0xff);
+  eeput ((byte *) p + 1, v >> 8);
+}
 
-ISR (PCINT0_vect)
+static void eesync (void)
 /*! 
- @brief     A dummy pin change interrupt
+ @brief     Waits until all queued EEPROM writes are complete
  
- This function is called whenever the system is in sleep mode and there
- is a level change on one of the contacts we are monitoring (Dit, Dah
- and the command key). As all handling is already taken care of by
- polling in the main routines, there is nothing we need to do here.
+ Needed before EEPROM is read, both to get the new values and because
+ a read must not be interrupted by the next write.
+ 
+ This is a private function.
+ */
+{
+  while (eebusy) yackbeat ();
+}
+
+#ifdef POWERSAVE
 
+HALISR (WDT_vect)
+/*! 
+ @brief     Keeps the time while powered down
+ 
+ The watchdog wakes the chip up after wdtms, as set by yackwake. The
+ time is added to the heartbeat counter, which stands still in power
+ down. Unless a pin change came first, the chip powers down again as
+ soon as the foreground has had its look at the time.
+ 
  */
 {
-  // Nothing to do here. All we want is to wake up.. 
+  beats += YACKMS (wdtms);
+  if (unattended) powerreq = TRUE;
+}
+
+void yackwake (word ms)
+/*! 
+ @brief     Sets the longest time to stay powered down
+ 
+ Without it the chip powers down until a contact is touched and the
+ heartbeat counter loses that time. With it, the watchdog interrupt
+ wakes the chip up and counts the time, so a foreground that keeps
+ time with yacktime, like the beacon, runs on. The watchdog periods
+ are 16 ms times a power of two up to 8192 ms, the longest one within
+ the limit is used. Longer limits take one wake-up per 8 s. The
+ watchdog oscillator is less accurate than the system clock, by some
+ percent.
+ 
+ @param ms  Time in ms, 0 to power down until a contact is touched
+ 
+*/
+{
+  word n = 8192;
+
+  while (n > ms && n > 16) n >>= 1;
+  wdtms = ms ? n : 0;
 }
 
 void yackpower (byte n)
@@ -334,36 +1026,38 @@ void yackpower (byte n)
  @brief     Manages the power saving mode
  
  This is called in yackbeat intervals with either a TRUE or FALSE as
- parameter. Whenever the parameter is TRUE a beat counter is advanced
- until the timeout level is reached. When timeout is reached, the chip
- shuts down and will only wake up again when issued a level change
- interrupt on either of the input pins.
+ parameter. Once it has been called with TRUE only for PSTIME seconds,
+ counted on the heartbeat clock, the chip is flagged to shut down. The
+ next yackbeat call in the foreground powers down and the chip will
+ only wake up again when issued a level change interrupt on either of
+ the input pins.
  
- When the parameter is FALSE, the counter is reset.
+ When the parameter is FALSE, the time is counted from now on and a
+ pending power down is cancelled. If only the watchdog has woken the
+ chip, nobody is there to wait for and it powers down again as soon as
+ it may.
+
+ The FSM calls this from the heartbeat interrupt, the foreground may
+ call it to inhibit sleep.
  
  @param n   TRUE: OK to sleep, FALSE: Can not sleep now
  
 */
 
 {
-  static uint32_t shdntimer=0;
-  if (n) {
-    // True = we could go to sleep
-    if (shdntimer++ == YACKSECS (PSTIME)) {
-      shdntimer = 0; // So we do not go to sleep right after waking up
-      set_sleep_mode (SLEEP_MODE_PWR_DOWN);
-      sleep_bod_disable ();
-      sleep_enable ();
-      sei ();
-      sleep_cpu ();
-      cli ();
-      // There is no technical reason to CLI here but it avoids hitting
-      // the ISR every time the paddles are touched. If the remaining
-      // code needs the interrupts this is OK to remove.
+  static word since = 0;   // Beats when sleep was last inhibited
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    if (n) {
+      // True = we could go to sleep
+      if (unattended || (word) (beats - since) >= YACKSECS (PSTIME)) {
+        since = beats; // So we do not go to sleep right after waking up
+        powerreq = TRUE;
+      }
+    } else {
+      // Passed parameter is FALSE
+      since = beats;
+      powerreq = FALSE;
     }
-  } else {
-    // Passed parameter is FALSE
-    shdntimer = 0;
   }
 }
 #endif
@@ -373,44 +1067,139 @@ void yacksave (void)
  @brief     Saves all permanent settings to EEPROM
  
  To save EEPROM write cycles, writing only happens when the flag
- DIRTYFLAG is set. After writing the flag is cleared
+ DIRTYFLAG is set. After writing the flag is cleared. The settings are
+ appended as one record to the journal, in the slot after the newest
+ one. The record is queued and written in the background, so this
+ returns at once.
  
  @callergraph
  
  */
 {
+  byte rec[JRECLEN];
+  byte n;
+
   if (volflags & DIRTYFLAG) {  // Dirty flag set?
-    eeprom_write_byte (&magic,    MAGPAT);
-    eeprom_write_word (&ctcstor,  ctcvalue);
-    eeprom_write_byte (&wpmstor,  wpm);
-    eeprom_write_byte (&flagstor, yackflags);
+    jslot = (jslot + 1) % JSLOTS;
+    rec[J_SEQ]   = ++jseq;
+    rec[J_FLAGS] = yackflags;
+    rec[J_CTCL]  = ctcvalue & 0xff;
+    rec[J_CTCH]  = ctcvalue >> 8;
+    rec[J_WPM]   = wpm;
+    rec[J_FARNS] = farns;
+    rec[J_CRC]   = crc8 (rec, J_CRC);
+    for (n = 0; n < JRECLEN; n++) eeput (&journal[jslot][n], rec[n]);
     volflags &= ~DIRTYFLAG;    // Clear the dirty flag
   }
   
 }
 
+static byte crc8 (const byte *p, byte n)
+/*! 
+ @brief     CRC-8 (polynomial x^8 + x^2 + x + 1, initial value 0xff)
+ 
+ This is a private function.
+ */
+{
+  byte crc = 0xff;
+  byte b;
+
+  while (n--) {
+    crc ^= *p++;
+    for (b = 0; b < 8; b++) 
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
+
+static byte journalload (void)
+/*! 
+ @brief     Recovers the newest valid settings record
+ 
+ All JSLOTS records are read once, so this takes bounded time. A record
+ is valid if its CRC matches and its values are within range. Sequence
+ numbers wrap, but the records present are at most JSLOTS saves apart,
+ so the difference to the best one so far tells which is newer.
+ 
+ This is a private function.
+ 
+ @return    TRUE if a valid record was found and loaded
+ */
+{
+  byte rec[JRECLEN];
+  byte best[JRECLEN];
+  byte found = FALSE;
+  byte i;
+
+  for (i = 0; i < JSLOTS; i++) {
+    word ctc;
+
+    haleereadblk (rec, journal[i], JRECLEN);
+    ctc = rec[J_CTCL] | (rec[J_CTCH] << 8);
+    if (crc8 (rec, J_CRC) != rec[J_CRC]
+        || rec[J_WPM] < MINWPM || rec[J_WPM] > MAXWPM 
+        || rec[J_FARNS] > MAXWPM || ctc < MAXCTC || ctc > MINCTC)
+      continue;
+
+    if (!found || (int8_t) (rec[J_SEQ] - best[J_SEQ]) > 0) {
+      memcpy (best, rec, JRECLEN);
+      jslot = i;
+      found = TRUE;
+    }
+  }
+
+  if (found) {
+    jseq      = best[J_SEQ];
+    yackflags = best[J_FLAGS];
+    ctcvalue  = best[J_CTCL] | (best[J_CTCH] << 8);
+    wpm       = best[J_WPM];
+    farns     = best[J_FARNS];
+  }
+  return found;
+}
+
 void yackinhibit (byte mode)
 /*! 
  @brief     Inhibits keying during command phases
  
  This function is used to inhibit and re-enable TX keying (if
  configured) and enforce the internal sidetone oscillator to be active
- so that the user can communicate with the keyer.
+ so that the user can communicate with the keyer. Characters still
+ queued are sent in the mode they were queued in, so the function
+ waits for them first. A paddle element or the straight key does not
+ hold it up, and when either breaks in on the queued characters keying
+ is enabled before its first element.
  
  @param mode   ON inhibits keying, OFF re-enables keying 
  
  */
 {
   if (mode) {
-    volflags &= ~(TXKEY | SIDETONE);
-    volflags |= SIDETONE;
+    yackflush ();
+    volflags = (volflags & ~(TXKEY | SIDETONE)) | SIDETONE;
   } else {
-    volflags &= ~(TXKEY | SIDETONE);
-    volflags |= yackflags & (TXKEY | SIDETONE);
-    yackkey (UP);
+    txresume = TRUE;
+    yackflush ();
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+      if (txresume) keyresume ();
+      if (!keying && !SKDOWN) yackkey (UP);
+    }
   }
 }
 
+static void keyresume (void)
+/*! 
+ @brief     Keys the transmitter and the sidetone as configured again
+ 
+ Interrupts must be disabled.
+ 
+ This is a private function.
+ */
+{
+  volflags = (volflags & ~(TXKEY | SIDETONE)) | (yackflags & (TXKEY | SIDETONE));
+  txresume = FALSE;
+}
+
 word yackuser (byte func, byte nr, word content)
 /*! 
  @brief     Saves user defined settings
@@ -428,16 +1217,17 @@ word yackuser (byte func, byte nr, word content)
  */
 {
   if (func == READ) {
+    eesync ();
     if (nr == 1) 
-      return eeprom_read_word (&user1);
+      return haleereadw (&user1);
     else if (nr == 2)
-      return eeprom_read_word (&user2);
+      return haleereadw (&user2);
   }
   if (func == WRITE) {
     if (nr == 1)
-      eeprom_write_word (&user1, content);
+      eeputw (&user1, content);
     else if (nr == 2)
-      eeprom_write_word (&user2, content);
+      eeputw (&user2, content);
   }
   return FALSE;
 }
@@ -457,14 +1247,53 @@ word yackwpm (void)
   return wpm; 
 }
 
+#ifdef STACKCHECK
+HALSTACKPAINT
+
+word yackstack (void)
+/*! 
+ @brief     Retrieves the stack margin
+ 
+ The RAM above the static data is painted before main runs. What the
+ stack has not overwritten since is the margin left, the lowest it has
+ been since power up.
+ 
+ @return        Bytes between the static data and the deepest stack
+ 
+ */
+{
+  return halstackfree ();
+}
+#endif
+
+#ifdef STATS
+word yackstat (byte n)
+/*! 
+ @brief     Retrieves a counter of the hot path
+ 
+ @param n       The counter, ST_OVERRUN to ST_LATENCY
+ @return        Its value, 0 if there is no such counter
+ 
+ */
+{
+  word v = 0;
+
+  if (n < NSTATS) {
+    ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+      v = stats[n];
+    }
+  }
+  return v;
+}
+#endif
+
 
 void yackspeed (byte dir)
 /*! 
  @brief     Increases or decreases the current WPM speed
  
- The amount of increase or decrease is in amounts of wpmcnt. Those are
- close to real WPM in a 10 ms heartbeat but can significantly differ at
- higher heartbeat speeds.
+ The speed changes in steps of 1 WPM. The dot length is rarely a whole
+ number of beats, see setpace for how the remainder is kept.
  
  @param dir     UP (faster) or DOWN (slower)
  
@@ -474,22 +1303,7 @@ void yackspeed (byte dir)
   if ((dir == UP)   && (wpm < MAXWPM)) wpm++;
   if ((dir == DOWN) && (wpm > MINWPM)) wpm--;
         
-  wpmcnt = (12000/YACKBEAT+wpm/2)/wpm; // Calculate beats
-
-  // wpm    wpmcnt
-  //  10       120
-  //  12       100
-  //  14        86
-  //  16        75
-  //  18	67
-  //  20	60
-  //  22  	55
-  //  24	50
-  //  25	48
-  //  30	40
-  //  35	34
-  //  40	30
-  //  50        24
+  setpace ();
 
   volflags |= DIRTYFLAG; // Set the dirty flag  
     
@@ -498,66 +1312,333 @@ void yackspeed (byte dir)
     
 }
 
-
-
-void yackbeat (void)
+byte yackfarns (byte n)
 /*! 
- @brief     Heartbeat delay
+ @brief     Sets the Farnsworth speed
+ 
+ Characters are still sent at the keyer speed, but the gaps between
+ characters and words are stretched so that the overall rate is n WPM.
+ The setting only takes effect while it is below the keyer speed.
  
- Several functions in the keyer are timing dependent. The most prominent
- example is the yackiambic function that implements the IAMBIC keyer
- finite state machine. The same expects to be called in intervals of
- YACKBEAT milliseconds. How this is implemented is left to the user. In
- a more complex application this would be done using an interrupt or a
- timer. For simpler cases this is a busy wait routine that delays
- exactly YACKBEAT ms.
+ @param n   Farnsworth speed in WPM, 0 to switch it off
+ @return    TRUE if the speed was accepted, FALSE if out of range
  
  */
 {
-  while ((TIFR & (1 << OCF1A)) == 0); // Wait for Timeout
-  TIFR |= (1 << OCF1A);               // Reset output compare flag
+  if (n != 0 && (n < MINWPM || n > MAXWPM)) return FALSE;
+
+  farns = n;
+  setpace ();
+  volflags |= DIRTYFLAG; // Set the dirty flag  
+  return TRUE;
 }
 
-void yackpitch (byte dir)
+static void setpace (void)
 /*! 
- @brief     Increases or decreases the sidetone pitch
+ @brief     Calculates the element and spacing lengths
  
- Changes are done not in Hz but in ctc control values. This is to avoid
- extensive calculations at runtime. As is all calculations are done by
- the preprocessor.
+ A dot is 12000/YACKBEAT/wpm beats, which is a whole number of beats
+ only at some speeds. The length is kept as whole beats plus a
+ remainder. The remainders are added up in a phase accumulator and a
+ beat is inserted whenever they add up to a whole one (see pace), so
+ the long-run rate is exact while each unit is within a beat.
  
- @param dir     UP or DOWN
+ Gaps between characters and words after the last element are counted
+ in spacing units. Without Farnsworth these are dots. With Farnsworth
+ speed fw below wpm, PARIS has 36 dots at wpm (elements and their
+ gaps) and 14 spacing units, which shall make up 50 dots at fw:
+ 
+   unit = 12000/YACKBEAT * (50 wpm - 36 fw) / (14 wpm fw)
+ 
+ This is a private function.
  
  */
 {
-  if (dir == UP)   ctcvalue--;
-  if (dir == DOWN) ctcvalue++;
-  if (ctcvalue < MAXCTC) ctcvalue = MAXCTC;
-  if (ctcvalue > MINCTC) ctcvalue = MINCTC;
-  
-  volflags |= DIRTYFLAG; // Set the dirty flag  
-  
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    wpmcnt = (12000/YACKBEAT) / wpm;
+    wpmrem = (12000/YACKBEAT) % wpm;
+
+    if (farns > 0 && farns < wpm) {
+      uint32_t n = (uint32_t) (12000/YACKBEAT) * (50*wpm - 36*farns);
+      spcdiv = 14 * wpm * farns;
+      spccnt = n / spcdiv;
+      spcrem = n % spcdiv;
+    } else {
+      spcdiv = wpm;
+      spccnt = wpmcnt;
+      spcrem = wpmrem;
+    }
+    opinit ();
+  }
 }
 
-void yacktune (void)
+static void opinit (void)
 /*! 
- @brief     Activates Tuning mode
+ @brief     Starts the operator timing over from the set speed
  
- This produces a solid keydown for TUNEDURATION seconds. After this the
- TX is unkeyed. The same can be achieved by presing either the DIT or
- the DAH contact or the control key.
+ Interrupts must be disabled.
+ 
+ This is a private function.
+ */
+{
+  byte i;
+
+  for (i = 0; i < OPN; i++) opavg[i] = (opnom[i] * wpmcnt) << OPFRAC;
+}
+
+static void optrack (byte i, word len)
+/*! 
+ @brief     Moves an average of the operator timing towards a sample
+ 
+ The average moves 1/2^OPRATE of the way, in fixed point. It is kept
+ within half and twice the nominal length, and samples beyond twice
+ the nominal are pauses, not timing, and ignored. For the paddle that
+ limit is taken from the end of the mark, as for the straight key, so
+ a slow operator's word pauses are not all dropped.
+ 
+ This is a private function.
+ 
+ @param i       The average, OP_DIT to OP_PWORD
+ @param len     The length keyed, in beats
+ */
+{
+  word nom = (opnom[i] * wpmcnt) << OPFRAC;
+  word gap = 0;                     // Character gap before a paddle pause
+  word x;
+
+#ifdef HOST
+  if (!oplearn) return;
+#endif
+  if (i >= OP_PCHAR) gap = ((IEGLEN + ICGLEN) * wpmcnt) << OPFRAC;
+  if (len > (2 * (nom + gap) - gap) >> OPFRAC) return;
+  x = len << OPFRAC;
+  if (x > opavg[i]) opavg[i] += (x - opavg[i]) >> OPRATE;
+  else opavg[i] -= (opavg[i] - x) >> OPRATE;
+
+  if (opavg[i] < nom / 2) opavg[i] = nom / 2;
+  if (opavg[i] > 2 * nom) opavg[i] = 2 * nom;
+}
+
+static word opcut (byte i)
+/*! 
+ @brief     Threshold between an average of the operator timing and the next
+ 
+ This is a private function.
+ 
+ @param i       The shorter average
+ @return        The threshold in beats
+ */
+{
+  return (opavg[i] + opavg[i + 1]) >> (OPFRAC + 1);
+}
+
+static word pace (byte n, byte spc)
+/*! 
+ @brief     Length of n dots or spacing units in beats
+ 
+ Each call advances the phase accumulator, so successive elements
+ together keep the exact rate. Called by the FSM, and from the
+ foreground only while the FSM is paused.
+ 
+ This is a private function.
+ 
+ @param n       Number of units
+ @param spc     FALSE for dots, TRUE for spacing units
+ @return        Number of beats
+ 
+ */
+{
+  static word dotphase = 0;   // Accumulated remainders, in 1/wpm
+  static word spcphase = 0;   // and in 1/spcdiv beats
+  word t = 0;
+
+  while (n--) {
+    if (spc) {
+      t += spccnt;
+      spcphase += spcrem;
+      if (spcphase >= spcdiv) {
+        spcphase -= spcdiv;
+        t++;
+      }
+    } else {
+      t += wpmcnt;
+      dotphase += wpmrem;
+      if (dotphase >= wpm) {
+        dotphase -= wpm;
+        t++;
+      }
+    }
+  }
+  return t;
+}
+
+word yacktime (void)
+/*! 
+ @brief     Reads the heartbeat counter
+ 
+ @return    Number of YACKBEAT intervals since start, wrapping at 65536
+ 
+ */
+{
+  word t;
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    t = beats;
+  }
+  return t;
+}
+
+void yackbeat (void)
+/*! 
+ @brief     Heartbeat delay
+ 
+ Several functions in the keyer are timing dependent. The keyer FSM
+ itself is run by the heartbeat interrupt every YACKBEAT ms. Foreground
+ loops that count time in beats call this routine, which waits until
+ the heartbeat interrupt has ticked since the previous call. Like the
+ compare flag it replaces, one tick is remembered, so a foreground that
+ was briefly busy does not lose time. A slowed down heartbeat is
+ brought back to YACKBEAT first.
+ 
+ */
+{
+  beatwait (FALSE);
+}
+
+void yackidle (void)
+/*! 
+ @brief     Waits for the next heartbeat, which may be a slow one
+ 
+ Like yackbeat, but while the keyer has nothing to do but wait for the
+ paddle the FSM slows the heartbeat down to 2^SLOWBEAT ms, so the CPU
+ wakes up a few times per second instead of every ms. A paddle edge
+ speeds it up again, as does a character queued by yackchar or a call
+ to yackbeat. For foreground loops that measure time with yacktime
+ rather than by counting beats, like the main loop.
+ 
+ */
+{
+  beatwait (TRUE);
+}
+
+static void beatfast (void)
+/*! 
+ @brief     Ends a slow heartbeat period
+ 
+ The time of the slow beat so far is counted and the next beat comes
+ at once, so that the FSM takes up a paddle edge without delay.
+ Timestamps move on by SLOWGAP, so that paddle edges from before are
+ far in the past. Interrupts must be disabled.
+ 
+ This is a private function.
+ */
+{
+  word n;
+
+  if (slow) {
+    slow = FALSE;
+    n = halbeatfast () / BEATCNT;
+    beats += n;
+    tickbase += SLOWGAP;
+#ifdef TELEMETRY
+    telcount (n);
+#endif
+  }
+}
+
+static void beatwait (byte mayslow)
+/*! 
+ @brief     Sleeps until the heartbeat has ticked since the last call
+ 
+ While waiting, the CPU is put in idle sleep. The timers keep running
+ and the next compare match interrupt wakes it up. This is also where
+ the chip powers down when the FSM has been idle for PSTIME seconds,
+ until a pin change or the watchdog set by yackwake, and where the
+ telemetry records of the FSM are turned into text.
+ 
+ This is a private function.
+ 
+ @param mayslow TRUE if the heartbeat may be slowed down
+ */
+{
+  static word lastbeat = 0;
+
+#ifdef TELEMETRY
+  telformat ();
+#endif
+
+  // The checks and going to sleep must be atomic, or a tick or an edge
+  // arriving in between would let us sleep through it.
+  ATOMIC_BLOCK (ATOMIC_FORCEON) {
+#ifdef POWERSAVE
+    // Not before EEPROM writes are done and queued characters sent
+    if (powerreq && !eebusy && txhead == txtail) {
+      powerreq = FALSE;
+      unattended = TRUE;       // Until a pin change wakes us
+#ifdef STATS
+      STATINC (ST_POWER);
+#endif
+      // Timer1 stops where it is. From a slow heartbeat the waking
+      // edge gets a beat at once, instead of up to 1 ms later.
+      if (!slow) {
+        slow = TRUE;
+        halbeatslow ();
+      }
+      halpowerdown (wdtms);
+    }
+#endif
+    slowok = mayslow;
+    if (!mayslow) beatfast ();
+    while (beats == lastbeat) halidle ();   // Sleep until the next tick
+    lastbeat = beats;
+  }
+}
+
+void yackpitch (byte dir)
+/*! 
+ @brief     Increases or decreases the sidetone pitch
+ 
+ Changes are done not in Hz but in ctc control values. This is to avoid
+ extensive calculations at runtime. As is all calculations are done by
+ the preprocessor.
+ 
+ @param dir     UP or DOWN
+ 
+ */
+{
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    if (dir == UP)   ctcvalue--;
+    if (dir == DOWN) ctcvalue++;
+    if (ctcvalue < MAXCTC) ctcvalue = MAXCTC;
+    if (ctcvalue > MINCTC) ctcvalue = MINCTC;
+  }
+  
+  volflags |= DIRTYFLAG; // Set the dirty flag  
+  
+}
+
+void yacktune (void)
+/*! 
+ @brief     Activates Tuning mode
+ 
+ This produces a solid keydown for TUNEDURATION seconds. After this the
+ TX is unkeyed. The same can be achieved by presing either the DIT or
+ the DAH contact or the control key.
  
 */
 {
   word timer = YACKSECS (TUNEDURATION);
+  byte hold = volflags & FGKEY;     // Keep the FSM off the key
   
+  keyidle ();
+  volflags |= FGKEY;
   yackkey (DOWN);
-  while (timer && (KEYINP & (1 << DITPIN)) 
-         && (KEYINP & (1 << DAHPIN)) && !yackctrlkey (TRUE) ) {
+  while (timer && (halkeys () & (1 << DITPIN)) 
+         && (halkeys () & (1 << DAHPIN)) && !yackctrlkey (TRUE) ) {
     timer--;
     yackbeat ();
   }
   yackkey (UP);
+  if (!hold) volflags &= ~FGKEY;
 }
 
 byte yackmode (byte mode)
@@ -573,8 +1654,8 @@ byte yackmode (byte mode)
  */
 {
   byte oldmode = yackflags & MODE;
-  yackflags &= ~MODE;
-  yackflags |= (MODE & mode);
+  yackflags = (yackflags & ~MODE) | (MODE & mode);
+  setmode ();
   volflags  |= DIRTYFLAG;             // Set the dirty flag  
   return oldmode;
 }
@@ -632,22 +1713,15 @@ static void yackkey (byte mode)
   if (mode == DOWN) {
     if (volflags & SIDETONE) {
       // Are we generating a Sidetone?
-      OCR0A = ctcvalue;    // Then switch on the Sidetone generator
-      OCR0B = ctcvalue;
-            
-      // Activate CTC mode
-      TCCR0A |= (1 << COM0B0 | 1 << WGM01);
-            
-      // Configure prescaler
-      TCCR0B = 1 << CS01;
+      haltoneon (ctcvalue);
     }
         
     if (volflags & TXKEY) {
       // Are we keying the TX?
       if (yackflags & TXINV) // Do we need to invert keying?
-        CLEARBIT (OUTPORT, OUTPIN);
+        haloutclr ();
       else
-        SETBIT (OUTPORT, OUTPIN);
+        haloutset ();
     }
 
   }
@@ -655,16 +1729,15 @@ static void yackkey (byte mode)
   if (mode == UP) {
     if (volflags & SIDETONE) {
       // Sidetone active?
-      TCCR0A = 0;
-      TCCR0B = 0;
+      haltoneoff ();
     }
         
     if (volflags & TXKEY) {
       // Are we keying the TX?
       if (yackflags & TXINV) // Do we need to invert keying?
-        SETBIT (OUTPORT, OUTPIN);
+        haloutset ();
       else
-        CLEARBIT (OUTPORT, OUTPIN);
+        haloutclr ();
     }
   }
 }
@@ -673,26 +1746,38 @@ void yackdel (byte n)
 /*! 
  @brief     Produces an active waiting delay for n Dit counts
  
- This is used during the playback functions where active waiting is needed
+ This is used during the playback functions where active waiting is
+ needed. The delay starts when the queued characters have been sent.
  
  @param n   number of Dit durations to delay (dependent on current keying speed!
  
  */
 {
-  while (n--) {
-    byte x = wpmcnt;
-    while (x--) yackbeat ();
-  }
+  byte hold = volflags & FGKEY;     // Keep the FSM off the key
+
+  keyidle ();
+  volflags |= FGKEY;
+  word x = pace (n, FALSE);
+  while (x--) yackbeat ();
+  if (!hold) volflags &= ~FGKEY;
 }
 
 void yackplay (byte i) 
 /*! 
  @brief     Key the TX / Sidetone for the duration of a Dit or a Dah
  
+ Unlike yackchar this keys from the foreground and returns when the
+ element and its gap are complete. The queued characters are sent
+ first.
+
  @param i   DIT or DAH
  
  */
 {
+  byte hold = volflags & FGKEY;     // Keep the FSM off the key
+
+  keyidle ();
+  volflags |= FGKEY;
   yackkey (DOWN); 
 
 #ifdef POWERSAVE
@@ -710,240 +1795,1108 @@ void yackplay (byte i)
   }
   yackkey (UP);
   yackdel (IEGLEN);    // Inter Element gap  
+  if (!hold) volflags &= ~FGKEY;
+
+}
+
+void yackchar (byte c)
+/*! 
+ @brief     Send a character in Morse code
+ 
+ This function queues a character for sending and returns. The keyer
+ FSM translates it into Morse and keys transmitter / sidetone with the
+ characters elements in the heartbeat interrupt, adding all necessary
+ gaps (as if the character was part of a longer word). Only when the
+ queue is full, the function waits for room.
+ 
+ If the character can not be translated, nothing is sent.
+ 
+ If a space is received, an interword gap is sent.
+ 
+ When the paddle is touched while queued characters are sent, the
+ operator breaks in. The element being sent is completed, the rest of
+ the character and the queue are dropped and, after an inter-character
+ gap, the paddle takes over.
+  
+ @param c   The character to send
+ 
+*/
+
+{
+  byte head = txhead;
+  byte next = (head + 1) & (TXQ - 1);
+
+  if (c == 0) return;
+
+  while (next == txtail) yackbeat ();  // Wait for room
+  
+  txqueue[head] = c;
+  txhead = next;
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    beatfast ();                       // The FSM picks it up in 1 ms
+  }
+}
+
+void yackflush (void)
+/*! 
+ @brief     Waits until the queued characters have been sent
+ 
+ Returns at once if the FSM is paused by foreground keying, as nothing
+ would be sent meanwhile.
+ 
+ */
+{
+  while (!(volflags & FGKEY) && (txactive || txhead != txtail)) 
+    yackbeat ();
+}
+
+static void keyidle (void)
+/*! 
+ @brief     Waits until the FSM leaves the key to the foreground
+ 
+ The queued characters are sent and an element keyed with the paddle
+ is completed, so that the caller can take over the key.
+ 
+ This is a private function.
+ */
+{
+  yackflush ();
+  while (!(volflags & FGKEY) && keying) yackbeat ();
+}
+
+void yackstring (const byte *p)
+/*! 
+ @brief     Sends a 0-terminated string in CW which resides in Flash
+ 
+ Reads character by character from flash and queues them for sending.
+ The transmitter and/or sidetone are keyed depending on feature bit
+ settings. Queueing stops when the command key is pressed or the
+ operator breaks in with the paddle.
+ 
+ @param p   Pointer to string location in FLASH 
+ 
+ */
+{
+  byte c;
+  
+  txbreak = FALSE;
+  while ((c = halpgmbyte (p++)) && !txbreak && !(yackctrlkey (FALSE))) 
+    yackchar (c);
+  // While end of string in flash not reached and ctrl not pressed abort
+  // now if someone presses command key Play the read character
+}
+
+void yacknumber (word n)
+/*! 
+ @brief     Sends a number in CW
+ 
+ Transforms a number up to 65535 into its digits and sends them in CW
+ 
+ @param n   The number to send
+ 
+ */
+{
+ byte buffer[5];
+ byte i = 0;
+  do {
+    buffer[i++] = n % 10; // Store remainder of division by 10
+    n /= 10;              // Divide by 10
+  } while (n > 0);        // At least one digit, also for 0
+  while (i > 0) {
+    switch (buffer[--i]) {
+      case 0: yackchar (C_0); break;
+      case 1: yackchar (C_1); break;
+      case 2: yackchar (C_2); break;
+      case 3: yackchar (C_3); break;
+      case 4: yackchar (C_4); break;
+      case 5: yackchar (C_5); break;
+      case 6: yackchar (C_6); break;
+      case 7: yackchar (C_7); break;
+      case 8: yackchar (C_8); break;
+      case 9: yackchar (C_9); break;
+    }
+  }
+  yackchar (C_SPACE);
+}
+
+
+
+// ***************************************************************************
+// CW Keying related functions
+// ***************************************************************************
+
+static byte keybits (byte pins)
+/*! 
+ @brief     Translates port levels into DITLATCH and DAHLATCH bits
+ 
+ This is a private function.
+
+ @param pins    Port levels, contacts are active low
+ @return        DITLATCH and DAHLATCH set for closed contacts
+ */
+{
+  byte swap = yackflags & PDLSWAP;
+  byte k = 0;
+
+  if (!(pins & (1 << (swap ? DAHPIN : DITPIN)))) k |= DITLATCH;
+  if (!(pins & (1 << (swap ? DITPIN : DAHPIN)))) k |= DAHLATCH;
+  return k;
+}
+
+word yackelements (byte c)
+/*! 
+ @brief     Translates a character into its elements
+ 
+ The elements are read from fibels. Codes of more than 7 elements,
+ such as the error prosign, are taken apart from the last element to
+ the first instead.
+ 
+ @param c   The character
+ @return    The elements, the first one in bit 0 and 1 for a dah,
+            followed by a 1 bit
+ */
+{
+  word e = halpgmbyte (&fibels[c]);
+  byte n;
+
+  if (e) return e;
+
+  e = 1;
+  for (n = NFIB-2; n > 1; n--) {
+    if (c >= f[n]) {
+      c -= f[n-2];
+      e <<= 1;
+      if (c >= f[n]) {
+	c -= f[--n]; 
+        e |= 1;         // Dah
+      }
+    }
+  }
+  return e;
+}
+
+byte yackascii (char a)
+/*! 
+ @brief     Translates an ASCII character into a character code
+ 
+ Lower case letters are taken as upper case.
+ 
+ @param a   The ASCII character
+ @return    The character code, 0 if Morse has none for it
+ */
+{
+  if (a >= 'a' && a <= 'z') a -= 'a' - 'A';
+  if (a < ' ' || a > '_') return 0;
+  return halpgmbyte (&asciicode[a - ' ']);
+}
 
+static void txclear (void)
+/*! 
+ @brief     Drops the queued characters
+ 
+ The element being keyed is completed by the FSM. If yackinhibit waits
+ for the queued characters, the keying is enabled at once, before the
+ paddle that broke in keys its first element. Outside of the
+ heartbeat interrupt this must be called with interrupts disabled.
+ 
+ This is a private function.
+ */
+{
+  txtail   = txhead;
+  txbits   = 0;
+  txactive = FALSE;
+#ifdef SERIAL
+  sertail  = serhead;
+#endif
+  if (txresume) keyresume ();
+}
+
+#ifdef SERIAL
+static void serialbits (word t)
+/*! 
+ @brief     Samples the bits of the serial frame with their middle before t
+ 
+ The RX line had the level serlevel up to t. A character with a valid
+ stop bit is translated and queued in serq, unless it has no Morse
+ code or the queue is full. Runs in interrupt context. The heartbeat
+ may pass a t just before the start of the frame, hence the signed
+ difference.
+ 
+ This is a private function.
+ 
+ @param t   Timestamp, in timer1 counts
+ */
+{
+  byte c, next;
+
+  while (serbit < SERIDLE
+         && (int16_t) (t - serstart) >= (int16_t) (serbit * BITCNT + BITCNT/2)) {
+    if (serbit == 0) {
+      if (serlevel) serbit = SERIDLE - 1;   // A glitch, not a start bit
+    } else if (serbit < 9) {
+      serdata >>= 1;                        // Least significant bit first
+      if (serlevel) serdata |= 0x80;
+    } else if (serlevel && (c = yackascii (serdata))) {
+      next = (serhead + 1) & (SERQ - 1);
+      if (next != sertail) {
+        serq[serhead] = c;
+        serhead = next;
+      }
+    }
+    serbit++;
+  }
+}
+
+static void serialedge (word t, byte level)
+/*! 
+ @brief     Takes an edge of the serial input
+ 
+ The bits up to the edge are sampled first. A falling edge outside a
+ frame starts the next one.
+ 
+ This is a private function.
+ 
+ @param t       Timestamp of the edge, in timer1 counts
+ @param level   Level of the RX line after the edge
+ */
+{
+  serialbits (t);
+  serlevel = level;
+  if (serbit == SERIDLE && !level) {
+    serstart = t;
+    serbit = 0;
+  }
+}
+#endif
+
+#ifdef TELEMETRY
+static void telpush (word space, word mark)
+/*! 
+ @brief     Records a keyed element or a decoded character
+ 
+ Called by the FSM and the straight key decoder. A record that does
+ not fit is dropped.
+ 
+ This is a private function.
+ 
+ @param space   Beats the key was up before the element, or the code
+                of the character
+ @param mark    Beats the element is keyed, 0 for a character
+ */
+{
+  byte next = (telhead + 1) & (TELQ - 1);
+
+  if (next != teltail) {
+    telspace[telhead] = space;
+    telmark[telhead]  = mark;
+    telhead = next;
+  }
+}
+
+static void telcount (word n)
+/*! 
+ @brief     Counts the time the key is up, up to MAX_WORD beats
+ 
+ This is a private function.
+ 
+ @param n   Beats
+ */
+{
+  telspc = (n < MAX_WORD - telspc) ? telspc + n : MAX_WORD;
+}
+
+static void telnumber (word n)
+/*! 
+ @brief     Puts a number in decimal and a blank into the telemetry text
+ 
+ This is a private function.
+ 
+ @param n   The number
+ */
+{
+  byte buffer[5];
+  byte i = 0;
+
+  do {
+    buffer[i++] = n % 10;
+    n /= 10;
+  } while (n > 0);
+  while (i > 0) {
+    telout[telouthead] = '0' + buffer[--i];
+    telouthead = (telouthead + 1) & (TELOUT - 1);
+  }
+  telout[telouthead] = ' ';
+  telouthead = (telouthead + 1) & (TELOUT - 1);
+}
+
+static void telformat (void)
+/*! 
+ @brief     Turns the telemetry records into text and starts sending it
+ 
+ Each character becomes one line: the space before each element and
+ its length, in ms, followed by the character, or * if it has no
+ ASCII equivalent. Records wait while the text does not fit. The
+ text is only started while the serial input is idle.
+ 
+ This is a private function.
+ */
+{
+  byte tail = teltail;
+  word c;
+  byte i;
+
+  while (tail != telhead
+         && ((telouttail - telouthead - 1) & (TELOUT - 1)) >= 12) {
+    if (telmark[tail]) {
+      telnumber (telspace[tail]);
+      telnumber (telmark[tail]);
+    } else {
+      c = telspace[tail];
+      for (i = 1; i < 64; i++)
+        if (c && halpgmbyte (&asciicode[i]) == c) break;
+      telout[telouthead] = (i < 64) ? ' ' + i : '*';
+      telouthead = (telouthead + 1) & (TELOUT - 1);
+      telout[telouthead] = '\n';
+      telouthead = (telouthead + 1) & (TELOUT - 1);
+    }
+    tail = (tail + 1) & (TELQ - 1);
+  }
+  teltail = tail;
+
+#ifdef SERIAL
+  if (serbit != SERIDLE) return;
+#endif
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    if (telbit == TELOFF && telouttail != telouthead) {
+      telbit = TELNEXT;
+      halbitstart ();
+    }
+  }
+}
+#endif
+
+static void keylatch (byte lastkey, word cutoff)
+/*! 
+ @brief     Latches the status of the DIT and DAH paddles
+ 
+ The paddle edges captured by the pin change interrupt are replayed in
+ the order they happened, up to the cutoff time. Later edges stay in
+ the queue until the next element. A contact change is accepted if it
+ is at least DEBOUNCE after the previous accepted change of the same
+ contact. Bounces within that time are ignored, and once it has passed
+ the contact is brought in line with the last captured level.
+ 
+ If either Dit or Dah are keyed, this function sets the corresponding
+ bit in latches. This is used by the Iambic keyer to determine which
+ element needs to be sounded next.
+ 
+ This is a private function.
+
+ @param lastkey The latches the last element was decided on
+ @param cutoff  Edges later than this are not considered yet
+
+ */
+{
+  static byte closed = 0;        // Debounced contacts
+  static byte raw = 0;           // Contacts as last captured
+  static word rawtime;           // Time of that capture
+  static word since[2];          // Time of the last accepted change
+  word now = ((int16_t) (cutoff - tickbase) > 0) ? tickbase : cutoff;
+  byte tail = edgetail;
+  byte more = TRUE;
+  byte b;
+
+  if (edgelost) {
+    // Start over from the port as it is now
+    edgelost = FALSE;
+    tail = edgehead;
+    raw = keybits (halkeys ());
+    rawtime = now;
+  }
+
+  while (more) {
+    more = (tail != edgehead) && ((int16_t) (edgetime[tail] - cutoff) <= 0);
+    if (more) {
+      raw = keybits (edgepins[tail]);
+      rawtime = edgetime[tail];
+      tail = (tail + 1) & (EDGEQ - 1);
+    }
+
+    for (b = DITLATCH; b <= DAHLATCH; b <<= 1) {
+      word *t = &since[b - 1];
+
+      if ((word) (now - *t) > 0x4000) *t = now - 0x4000; // Age out
+
+      if (((raw ^ closed) & b) && (word) ((more ? rawtime : now) - *t) >= DEBOUNCE) {
+        closed ^= b;             // Accept the change, at the time of the edge
+        *t = rawtime;
+#ifdef STATS
+        if (closed & b) lastclose = rawtime;
+#endif
+      }
+
+      // The latch is set when a contact closes and cleared when it
+      // opens, relative to the last element. This is done for every
+      // accepted edge, so that a short tap is not lost.
+
+      if ((closed & b) && !(lastkey & b))
+        latches |= b;
+      else if (!(closed & b) && (lastkey & b))
+        latches &= ~b;
+    }
+  }
+  edgetail = tail;
+}
+
+#if MODEIN (STRAIGHT, STRAIGHT)
+static void skedge (word t, byte closed)
+/*! 
+ @brief     Keys the transmitter with the straight key
+ 
+ A change is taken if it comes DEBOUNCE after the previous one. A
+ closure breaks in on the queued output, and takes effect once the
+ element being sent is complete. Called from the pin change and the
+ heartbeat interrupts.
+ 
+ This is a private function.
+ 
+ @param t       Time of the change, in timer1 counts
+ @param closed  TRUE if the key is closed
+ */
+{
+  if (closed == skdown || (word) (t - sktime) < DEBOUNCE) return;
+
+  if (closed && (txactive || txhead != txtail)) {
+    txclear ();
+    txbreak = TRUE;
+  }
+  if (keying) return;
+
+  skdown = closed;
+  sktime = t;
+  yackkey (closed ? DOWN : UP);
+  if (closed) {
+    skstart = beats;
+    skbusy  = TRUE;
+  } else {
+    skmark  = beats - skstart + 1; // Never 0, even if shorter than a beat
+  }
+}
+
+#if (NFIB == 13)
+static byte skfsm (byte ctrl)
+#else
+static word skfsm (byte ctrl)
+#endif
+/*! 
+ @brief     Decodes the straight key, once per heartbeat
+ 
+ A mark of two dits or more is a dah. A space ends the character or
+ the word halfway between the gaps the operator keys for those, see
+ optrack. The character gap learns only from the spaces in the lower
+ half of its range, so short word gaps do not stretch it until the
+ characters run together. A change the DEBOUNCE lockout has hidden is
+ caught up with here. The marks and characters are reported in the
+ telemetry as the paddle ones are.
+ 
+ This is a private function.
+ 
+ @param ctrl    ON if the keyer should recognize when a word ends. OFF if not.
+ @return        The character if one was recognized, /0 if not
+ */
+{
+  static word idle = 0;             // Beats since the key opened
+  static byte bcntr = 0;            // Number of elements decoded
+#if (NFIB == 13)
+  static byte buffer = 1;           // The character so far
+  byte retchar = 0;
+#else
+  static word buffer = 1;
+  word retchar = 0;
+#endif
+  word cut;                         // Threshold of a word gap
+
+  if ((word) (tickbase - sktime) > 0x4000) sktime = tickbase - 0x4000; // Age out
+  skedge (tickbase, keybits (halkeys ()) & DITLATCH);
+
+  if (skmark) {
+    if (skmark < opavg[OP_DIT] >> (OPFRAC - 1)) {
+      optrack (OP_DIT, skmark);
+      if (bcntr < NFIB-2) buffer += f[bcntr++];
+#if (NFIB == 13)
+      else buffer = MAX_BYTE;
+#else
+      else buffer = MAX_WORD;
+#endif
+    } else {
+      optrack (OP_DIT, skmark / 3);
+      if (bcntr < NFIB-3) {
+        buffer += f[++bcntr];
+        buffer += f[++bcntr];
+#if (NFIB == 13)
+      } else buffer = MAX_BYTE;
+#else
+      } else buffer = MAX_WORD;
+#endif
+    }
+#ifdef TELEMETRY
+    telpush (telspc, skmark);
+    telspc = 0;
+#endif
+    skmark = 0;
+  }
+
+  if (skdown) {
+    if (idle > 0) {             // The space before this mark
+      cut = opcut (OP_CHAR);
+      if (idle >= cut)
+        optrack (OP_WORD, idle);
+      else if (idle >= opcut (OP_DIT)
+               && idle < (cut + (opavg[OP_CHAR] >> OPFRAC)) / 2)
+        optrack (OP_CHAR, idle);
+    }
+    idle = 0;
+  } else if (idle < MAX_WORD) {
+    idle++;
+  }
+
+  if (bcntr > 0 && idle >= opcut (OP_DIT)) {
+    retchar = (buffer < f[NFIB-1]) ? buffer : 0;
+#ifdef TELEMETRY
+    telpush (retchar, 0);
+#endif
+    bcntr = 0;
+    buffer = C_SPACE;
+  } else if (ctrl && idle == opcut (OP_CHAR)) {
+    retchar = C_SPACE;
+  }
+  skbusy = skdown || bcntr > 0 || idle <= opcut (OP_CHAR);
+  return retchar;
+}
+#endif
+
+static void ckfsm (void)
+/*! 
+ @brief     Debounces the command button, once per heartbeat
+ 
+ A change of the button is accepted when it has lasted CKDEBOUNCE ms.
+ A press stops the keying and drops the queued characters. On release
+ the press is reported as a CKCLICK, or a CKHOLD if it lasted
+ CKHOLDTIME seconds, unless a paddle was touched meanwhile. While the
+ button is held with a paddle the speed goes up (dit) or down (dah)
+ by one WPM at once and then CKRATE times per second.
+ 
+ This is a private function.
+ */
+{
+  byte down = !(halbutton () & (1 << BTNPIN));
+  byte keys;
+
+  if (down == ckdown) {
+    ckbounce = 0;
+  } else if (++ckbounce >= YACKMS (CKDEBOUNCE)) {
+    ckbounce = 0;
+    ckdown = down;
+    if (down) {
+      ckheld = 0;
+      ckstep = 0;
+      ckspeed = FALSE;
+      txclear ();
+      if (!(volflags & FGKEY)) yackkey (UP);
+    } else if (!ckspeed) {
+      ckevent = (ckheld >= YACKSECS (CKHOLDTIME)) ? CKHOLD : CKCLICK;
+    }
+  }
+
+  if (!ckdown) return;
+
+  if (ckheld < MAX_WORD) ckheld++;
+#ifdef POWERSAVE
+  yackpower (FALSE);
+#endif
+
+  keys = ~halkeys () & ((1 << DITPIN) | (1 << DAHPIN));
+  if (!keys) {
+    ckstep = 0;                    // The next touch steps at once
+  } else if (ckstep) {
+    ckstep--;
+  } else {
+    ckstep = YACKSECS (1) / CKRATE - 1;
+    ckspeed = TRUE;
+    if (keys & (1 << DITPIN)) {
+      if (wpm < MAXWPM) wpm++;
+    } else {
+      if (wpm > MINWPM) wpm--;
+    }
+    setpace ();
+    ckstepped = TRUE;
+  }
+}
+
+byte yackctrlkey (byte mode) {
+/*! 
+ @brief     Scans for the Control key
+ 
+ This function is regularly called at different points in the program
+ and returns at once. The button itself is debounced in the heartbeat
+ interrupt, see ckfsm, so keying goes on while it bounces or is held.
+ A press is reported once it has been released.
+ 
+ If one of the paddles was closed while the button was held, the wpm
+ speed was changed and the keypress is not reported. The new speed is
+ played back here as a dit and a dah on the sidetone, and saved when
+ the button is released.
+
+ @param mode    TRUE if caller has taken care of command key press, FALSE if not
+ @return        CKCLICK or CKHOLD if a press of the command key is not
+                yet handled, 0 if none
+ 
+ @callergraph
+ 
+ */
+  byte e;
+
+  if (ckstepped) {
+    ckstepped = FALSE;
+    volflags |= DIRTYFLAG;
+    if (ckdown) {
+      byte vs = volflags;
+
+      yackinhibit (ON);           // Sidetone only
+      yackplay (DIT);
+      yackplay (DAH);
+      volflags = (volflags & ~(TXKEY | SIDETONE)) | (vs & (TXKEY | SIDETONE));
+    }
+  }
+
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    e = ckevent;
+    if (mode == TRUE) ckevent = 0; // Does caller want us to reset latch?
+  }
+
+  if (!ckdown) yacksave (); // In case we had a speed change
+    
+  return e;
+}
+
+
+static byte eeget (const byte *p)
+/*! 
+ @brief     Reads a byte from EEPROM once pending writes are done
+ 
+ This is a private function.
+ */
+{
+  eesync ();
+  return haleeread (p);
+}
+
+static void bitseek (word pos)
+/*! 
+ @brief     Moves the read position of the message stream
+ 
+ This is a private function.
+ */
+{
+  rpos = pos;
+  if (pos & 7) rbyte = eeget (eemacro + (pos >> 3));
+}
+
+static byte bitget (byte n)
+/*! 
+ @brief     Reads n bits from the message stream
+ 
+ Past the end of the area 0 bits are read.
+ 
+ This is a private function.
+ */
+{
+  byte v = 0;
+
+  while (n--) {
+    if (!(rpos & 7)) rbyte = (rpos < MACROBITS) ? eeget (eemacro + (rpos >> 3)) : 0;
+    v = (v << 1) | ((rbyte >> (7 - (rpos & 7))) & 1);
+    rpos++;
+  }
+  return v;
+}
+
+static void bitopen (word pos)
+/*! 
+ @brief     Moves the write position of the message stream
+ 
+ The bits before it in the same byte are kept.
+ 
+ This is a private function.
+ */
+{
+  wpos = pos;
+  wbyte = (pos & 7) ? eeget (eemacro + (pos >> 3)) & ~(0xff >> (pos & 7)) : 0;
+}
+
+static void bitput (byte v, byte n)
+/*! 
+ @brief     Writes the n low bits of v to the message stream
+ 
+ A byte is queued for writing once all its bits are known. The caller
+ checks that they fit.
+ 
+ This is a private function.
+ */
+{
+  while (n--) {
+    if ((v >> n) & 1) wbyte |= 0x80 >> (wpos & 7);
+    if (!(++wpos & 7)) {
+      eeput (eemacro + (wpos >> 3) - 1, wbyte);
+      wbyte = 0;
+    }
+  }
+}
+
+static void bitflush (void)
+/*! 
+ @brief     Writes the last, partly filled byte of the message stream
+ 
+ This is a private function.
+ */
+{
+  if (wpos & 7) eeput (eemacro + (wpos >> 3), wbyte);
+}
+
+static byte symget (void)
+/*! 
+ @brief     Reads the next symbol of a message
+ 
+ The code is walked one length at a time. At each length the codes
+ that are that long follow right after the longer ones' prefixes, so
+ the code read so far is a symbol when it is below first + count.
+ 
+ This is a private function.
+ 
+ @return    The character, M_REP or M_END
+ */
+{
+  word code = 0;           // Code read so far
+  word first = 0;          // First code of this length
+  byte index = 0;          // Symbol of the first code
+  byte count;              // Number of codes of this length
+  byte len, c;
+
+  for (len = 0; len < 8; len++) {
+    if (rpos >= MACROBITS) break;
+    code |= bitget (1);
+    count = halpgmbyte (&symcount[len]);
+    if (code < first + count) {
+      c = halpgmbyte (&symbols[index + code - first]);
+      return (c == M_ESC) ? bitget (8) : c;
+    }
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return M_END;
+}
+
+static byte symput (byte c, byte reserve)
+/*! 
+ @brief     Writes a symbol to the message stream
+ 
+ This is a private function.
+ 
+ @param c       Character, M_REP or M_END
+ @param reserve Number of bits that must remain free after it
+ @return        FALSE if it did not fit
+ */
+{
+  byte esc = sizeof (symbols) - 1;
+  byte code = 0;           // First code of this length
+  byte index = 0;          // Symbol of the first code
+  byte count;              // Number of codes of this length
+  byte i, len;
+
+  for (i = 0; i < esc && halpgmbyte (&symbols[i]) != c; i++) ;
+
+  for (len = 1; ; len++) {
+    count = halpgmbyte (&symcount[len-1]);
+    if (i < index + count) break;
+    index += count;
+    code = (code + count) << 1;
+  }
+
+  if (wpos + len + (i == esc ? 8 : 0) + reserve > MACROBITS) return FALSE;
+  bitput (code + i - index, len);
+  if (i == esc) bitput (c, 8);
+  return TRUE;
+}
+
+static void macroopen (void)
+/*! 
+ @brief     Starts encoding a message at the write position
+ 
+ This is a private function.
+ */
+{
+  mlen = mprev = 0;
+  mspace = FALSE;
 }
 
-void yackchar (byte c)
+static byte wordfind (byte n, byte whole)
 /*! 
- @brief     Send a character in Morse code
- 
- This function translates a character passed as parameter into Morse It
- then keys transmitter / sidetone with the characters elements and adds
- all necessary gaps (as if the character was part of a longer word).
- 
- If the character can not be translated, nothing is sent.
+ @brief     Looks up the word being recorded in dict
  
- If a space is received, an interword gap is sent.
-  
- @param c   The character to send
+ This is a private function.
  
-*/
-
+ @param n       Number of characters of it to compare
+ @param whole   TRUE if the dict word must not be longer
+ @return        Symbol of the first dict word matching, 0 if none
+ */
 {
-  byte n;           // Dit counter
-  char buf[NFIB]; 
-  byte i = 0;       // element counter
-
-  if (c == 0) return;
-
-  if (c == 1) {
-    yackdel (IWGLEN);
-    return;
-  }
+  const byte *q = dict;
+  byte i, k, c;
 
-  for (n = NFIB-2; n > 1; n--) {
-    if (c >= f[n]) {
-      c -= f[n-2];
-      if (c >= f[n]) {
-	c -= f[--n]; 
-        buf[i++] = 1;   // Dah
-      } else {
-	buf[i++] = 0;   // Dit
-      }
-    }
+  for (i = 0; i < DICTWORDS; i++) {
+    for (k = 0; (c = halpgmbyte (q + k)) && k < n && c == mword[k]; k++) ;
+    if (k == n && !(whole && c)) return M_WORD + i;
+    while (halpgmbyte (q++)) ;
   }
-  while (i > 0) {
-    yackplay (buf[--i] ? DAH : DIT);
-  }
-  yackdel (ICGLEN);
+  return 0;
 }
 
-void yackstring (const byte *p)
+static byte wordend (void)
 /*! 
- @brief     Sends a 0-terminated string in CW which resides in Flash
+ @brief     Writes the word being recorded when it ends
  
- Reads character by character from flash, translates into CW and keys
- the transmitter and/or sidetone depending on feature bit settings.
+ A word held back is written as M_REP or its dict symbol if it is one,
+ and else as the characters held.
  
- @param p   Pointer to string location in FLASH 
+ This is a private function.
  
+ @return    FALSE if the area is full
  */
 {
-  byte c;
-  while ((c = pgm_read_byte (p++)) && !(yackctrlkey (FALSE))) yackchar (c);
-  // While end of string in flash not reached and ctrl not pressed abort
-  // now if someone presses command key Play the read character
+  byte ok = TRUE;
+  byte s = 0;
+  byte i;
+
+  if (mhold) {
+    s = (msame && mlen == mprev) ? M_REP : wordfind (mlen, TRUE);
+    if (s) ok = symput (s, M_RESERVE);
+    for (i = 0; !s && i < mlen && ok; i++) ok = symput (mword[i], M_RESERVE);
+  }
+  if (s != M_REP) mprev = (mlen <= WORDLEN) ? mlen : 0;
+  mlen = 0;
+  return ok;
 }
 
-void yacknumber (word n)
+static byte macroput (byte c)
 /*! 
- @brief     Sends a number in CW
+ @brief     Encodes the next character of a message
  
- Transforms a number up to 65535 into its digits and sends them in CW
+ A word is held back in mword as long as it may turn out to be the
+ previous word or one in dict. The space after a word is only written
+ when the next word starts, so a message never ends with one.
  
- @param n   The number to send
+ This is a private function.
  
+ @return    FALSE if the area is full
  */
 {
- byte buffer[5];
- byte i = 0;
-  while (n > 0) {
-    buffer[i++] = n % 10; // Store remainder of division by 10
-    n /= 10;              // Divide by 10
-   }
-  while (i > 0) {
-    switch (buffer[--i]) {
-      case 0: yackchar (C_0); break;
-      case 1: yackchar (C_1); break;
-      case 2: yackchar (C_2); break;
-      case 3: yackchar (C_3); break;
-      case 4: yackchar (C_4); break;
-      case 5: yackchar (C_5); break;
-      case 6: yackchar (C_6); break;
-      case 7: yackchar (C_7); break;
-      case 8: yackchar (C_8); break;
-      case 9: yackchar (C_9); break;
+  byte ok = TRUE;
+  byte i;
+
+  if (c >= M_WORD) return TRUE;
+
+  if (c == C_SPACE) {
+    if (mlen) {
+      ok = wordend ();
+      mspace = TRUE;
     }
+    return ok;
   }
-  yackchar (C_SPACE);
-}
-
 
+  if (mspace) {
+    ok = symput (C_SPACE, M_RESERVE);
+    mspace = FALSE;
+  }
 
-// ***************************************************************************
-// CW Keying related functions
-// ***************************************************************************
+  if (!mlen) {
+    mhold = TRUE;
+    msame = (mprev != 0);
+  }
+  if (msame && (mlen >= mprev || mword[mlen] != c)) msame = FALSE;
+  if (mlen < WORDLEN) mword[mlen] = c;
+  if (mlen < MAX_BYTE) mlen++;
+
+  if (mhold) {
+    if (mlen <= WORDLEN && (msame || wordfind (mlen, FALSE))) return ok;
+    mhold = FALSE;         // Not a known word, write what was held
+    for (i = 0; i + 1 < mlen && ok; i++) ok = symput (mword[i], M_RESERVE);
+  }
+  return ok && symput (c, M_RESERVE);
+}
 
-static void keylatch (byte lastkey)
+static void macroclose (void)
 /*! 
- @brief     Latches the status of the DIT and DAH paddles
+ @brief     Ends the message being encoded
  
- If either Dit or Dah are keyed, this function sets the corresponding
- bit in volflags. This is used by the Iambic keyer to determine which
- element needs to be sounded next.
+ A word still held back is written as far as it fits.
  
  This is a private function.
-
  */
-
-  // TODO: include IAMBIC function: detect which key is pressed
-  // first
 {
-  byte swap = yackflags & PDLSWAP;
-  // Note dit and dah go zero when key is pressed
-  byte dit = (KEYINP & (1 << (swap ? DAHPIN : DITPIN))) != 0;
-  byte dah = (KEYINP & (1 << (swap ? DITPIN : DAHPIN))) != 0;
-
-  static byte ditcnt = 0;
-  static byte dahcnt = 0;
-
-  if (ditcnt < YACKCNTS && dit) ditcnt++;
-  if (ditcnt > 0 && (!dit)) ditcnt--;
-
-  if (dahcnt < YACKCNTS && dah) dahcnt++;
-  if (dahcnt > 0 && (!dah)) dahcnt--;
+  if (mlen) wordend ();
+  symput (M_END, 0);
+}
 
-  if ((ditcnt >= YACKCNTS) && (lastkey & DITLATCH))
-    volflags &= ~DITLATCH; 
-  else if ((ditcnt <= 0) && !(lastkey & DITLATCH))
-    volflags |= DITLATCH; 
+static void wordplay (byte s)
+/*! 
+ @brief     Queues the characters of a dict word
+ 
+ This is a private function.
+ */
+{
+  const byte *q = dict;
+  byte c;
 
-  if ((dahcnt >= YACKCNTS) && (lastkey & DAHLATCH))
-    volflags &= ~DAHLATCH; 
-  else if ((dahcnt <= 0) && !(lastkey & DAHLATCH))
-    volflags |= DAHLATCH; 
+  while (s-- > M_WORD) while (halpgmbyte (q++)) ;
+  while ((c = halpgmbyte (q++))) yackchar (c);
 }
 
-byte yackctrlkey (byte mode) {
+static word macrostart (byte nr)
 /*! 
- @brief     Scans for the Control key
+ @brief     Looks up a message in the directory
  
- This function is regularly called at different points in the program.
- In a normal case it terminates instantly. When the command key is found
- to be closed, the routine idles until it is released again and returns
- a TRUE return value.
+ This is a private function.
  
- If, during the period where the contact was closed one of the paddles
- was closed too, the wpm speed is changed and the keypress not
- interpreted as a Control request. 
+ @param nr  Message number
+ @return    Its start (bits), MAX_WORD if there is no such message
+ */
+{
+  word p;
 
- @param mode    TRUE if caller has taken care of command key press, FALSE if not
- @return        TRUE if a press of the command key is not yet handled. 
+  if (nr < 1 || nr > MACROS) return MAX_WORD;
+  eesync ();
+  p = haleereadw (&eedir[nr-1]);
+  return (p < MACROBITS) ? p : MAX_WORD;
+}
+
+static word macroend (void)
+/*! 
+ @brief     Finds the end of the messages, where free space starts
  
- @callergraph
+ That is the end of the message starting last.
+ 
+ This is a private function.
  
+ @return    End of the messages (bits)
  */
-  byte volbfr = volflags; // Remember current volatile settings
-    
-  if (!(BTNINP & (1 << BTNPIN))) {
-    // If command button is pressed
-    volbfr |= CKLATCH; // Set control key latch
-    
-    // Apparently the control key has been pressed. To avoid bouncing We
-    // will now wait a short while and then busy wait until the key is
-    // released. Should we find that someone is keying the paddle, let
-    // him change the speed and pretend ctrl was never pressed in the
-    // first place..
+{
+  word last = MAX_WORD;
+  word p;
+  byte n;
 
-    yackinhibit (ON); // Stop keying, switch on sidetone.
-    
-    _delay_ms (50);
-    
-    while(!(BTNINP & (1 << BTNPIN))) {
-      // Busy wait for release
-            
-      if (!( KEYINP & (1 << DITPIN))) {
-        // Someone pressing DIT paddle
-        yackspeed (UP);
-        volbfr &= ~CKLATCH; // Ignore that control key was pressed
-      }  
-      
-      if (!( KEYINP & (1 << DAHPIN))) {
-        // Someone pressing DAH paddle
-        yackspeed (DOWN);
-        volbfr &= ~CKLATCH;
-      }  
-    }
-    _delay_ms (50); // Trailing edge debounce  
+  for (n = 1; n <= MACROS; n++) {
+    p = macrostart (n);
+    if (p != MAX_WORD && (last == MAX_WORD || p > last)) last = p;
   }
+  if (last == MAX_WORD) return 0;
 
-  volflags = volbfr; // Restore previous state
+  bitseek (last);
+  while (symget () != M_END) ;
+  return rpos;
+}
 
-  if (mode == TRUE) {
-    // Does caller want us to reset latch?
-    volflags &= ~CKLATCH;
+static word macrodrop (byte nr)
+/*! 
+ @brief     Removes a stored message
+ 
+ The messages after it are moved down bit by bit to close the gap, so
+ all free space is at the end, and their directory entries are
+ adjusted. The write position stays behind the read position, so only
+ bits already read are overwritten.
+ 
+ This is a private function.
+ 
+ @param nr  Message number
+ @return    End of the messages, where free space starts (bits)
+ */
+{
+  word start = macrostart (nr);
+  word end = macroend ();
+  word gap, p;
+  byte n;
+
+  if (start == MAX_WORD) return end;
+  eeputw (&eedir[nr-1], MAX_WORD);
+
+  bitseek (start);
+  while (symget () != M_END) ;
+  gap = rpos - start;
+
+  bitopen (start);
+  while (rpos + 8 <= end) bitput (bitget (8), 8);
+  bitput (bitget (end - rpos), end - rpos);
+  bitflush ();
+
+  for (n = 1; n <= MACROS; n++) {
+    p = macrostart (n);
+    if (p != MAX_WORD && p > start) eeputw (&eedir[n-1], p - gap);
   }
-    
-  yacksave (); // In case we had a speed change
-    
-  return (volbfr & CKLATCH) != 0; 
-  // Tell caller if we had a ctrl button press
-  
+  return end - gap;
 }
 
+word yackstore (byte msgnr, const byte *p)
+/*! 
+ @brief     Stores a message from flash
+ 
+ The old message is removed first. If the new one does not fit, what
+ fits is stored.
+ 
+ @param msgnr   Message number, 1 to MACROS
+ @param p       Pointer to a 0 terminated string of characters in flash
+ @return        Number of bits the message takes, 0 if it did not fit
+ */
+{
+  word start;
+  byte ok = FALSE;
+  byte c;
+
+  if (msgnr < 1 || msgnr > MACROS) return 0;
+  start = macrodrop (msgnr);
+  if (start + M_RESERVE > MACROBITS) return 0;
+
+  bitopen (start);
+  macroopen ();
+  ok = TRUE;
+  while (ok && (c = halpgmbyte (p++))) ok = macroput (c);
+  macroclose ();
+  bitflush ();
+  eeputw (&eedir[msgnr-1], start);
+  return ok ? wpos - start : 0;
+}
 
 void yackmessage (byte function, byte msgnr)
 /*! 
  @brief     Handles EEPROM stored CW messages (macros)
  
- When called in RECORD mode, the function records a message up to 100
- characters and stores it in EEPROM. The routine stops recording when
- timing out after DEFTIMEOUT seconds. Recording can be aborted using the
- control key. If more than 100 characters are recorded, the error
- prosign is sounded and recording starts from the beginning. After
- recording and timing out the message is played back once before it is
- stored. To erase a message, do not key one.
+ When called in RECORD mode, the old message is removed and the
+ characters keyed are encoded and appended to EEPROM as they are
+ decoded. The routine stops recording when timing out after DEFTIMEOUT
+ seconds. Recording can be aborted using the control key, which leaves
+ the message erased. The messages share MACROSIZE bytes. When they are
+ full, the error prosign is sounded and recording ends with what fits.
+ After recording and timing out the message is played back once. To
+ erase a message, do not key one.
  
- When called in PLAY mode, the message is just played back. Playback can
- be aborted using the command key.
+ When called in PLAY mode, the message is decoded from EEPROM
+ character by character as the output queue takes them. Playback stops
+ when the operator breaks in.
  
  @param     function    RECORD or PLAY
- @param     msgnr       1 or 2
- @return    TRUE if all OK, FALSE if lock prevented message recording
+ @param     msgnr       1 to MACROS
  
  */
 {
-  byte rambuffer[RBSIZE];  // Storage for the message
 #if (NFIB == 13)
   byte c;                  // Work character
 #else
@@ -952,66 +2905,85 @@ void yackmessage (byte function, byte msgnr)
 
   word extimer = 0;        // Detects end of message (10 sec)
   
-  byte i = 0;              // Pointer into RAM buffer
-  byte n;                  // Generic counter
+  word start;              // Start of the message (bits)
+  byte started = FALSE;    // A character was stored
+  
+  word word1, word2;       // Start of the previous and this word
+  word resume = 0;         // Where to continue after a repeated word
+  byte rep = FALSE;        // This word is a repeated one
+  
+  if (msgnr < 1 || msgnr > MACROS) return;
   
   if (function == RECORD) {
+    start = macrodrop (msgnr);
+    bitopen (start);
+    macroopen ();
+    
     extimer = YACKSECS (DEFTIMEOUT);  // 5 Second until message end
     while (extimer--) {
       // Continue until we waited 5 seconds
-      if (yackctrlkey (FALSE)) return;
+      if (yackctrlkey (FALSE))
+        return;                         // Abort, the message is erased
       
       if ((c = yackiambic (ON))) {
         // Check for a character from the key
-        rambuffer[i++] = c; // Add that character to our buffer
+        if (!started && c != C_SPACE) {
+          if (start + M_RESERVE > MACROBITS) break;
+          started = TRUE;
+        }
+        if (started && !macroput (c)) {
+          // End of space reached
+          yackchar (C_HH);
+          break;
+        }
         extimer = YACKSECS (DEFTIMEOUT); // Reset End of message timer
       }
       
-      if (i >= RBSIZE) {
-        // End of buffer reached?
-        yackchar (C_HH);
-        i = 0;
-      }
       yackbeat (); // 1 ms heartbeat
     }  
     
     // Extimer has expired. Message has ended
     
-    if (i > 0) {
-      // Was anything received at all?
-      rambuffer[--i] = 0; // Add a \0 end marker over last space
-      
-      // Replay the message
-      for (n = 0; n < i; n++) yackchar (rambuffer[n]);
-      
-      // Store it in EEPROM
-      switch (msgnr) {
-        case 1:
-          eeprom_write_block (rambuffer, eebuffer1, RBSIZE);
-	  break;
-        default:
-          eeprom_write_block (rambuffer, eebuffer2, RBSIZE);
-	  break;
-      }
-    } else
-      yackchar (C_HH);
+    if (started) {
+      macroclose ();
+      bitflush ();
+      eeputw (&eedir[msgnr-1], start);  // Enter it in the directory
+      yackmessage (PLAY, msgnr);        // Replay the message
+    } else {
+      yackchar (C_HH);                  // Nothing stored
+    }
   }
   
   if (function == PLAY) {
-    // Retrieve the message from EEPROM
-    switch (msgnr) {
-      case 1:
-        eeprom_write_block (rambuffer, eebuffer1, RBSIZE);
-        break;
-      default:
-        eeprom_write_block (rambuffer, eebuffer2, RBSIZE);
+    txbreak = FALSE;
+    
+    // Replay the message, until the operator breaks in. A repeated
+    // word is read again from where the previous one started.
+    if ((start = macrostart (msgnr)) == MAX_WORD) return;
+    bitseek (start);
+    word1 = word2 = start;
+    while (!txbreak) {
+      c = symget ();
+      if (resume) {
+        if (c == C_SPACE || c == M_END || c == M_REP) {
+          bitseek (resume);             // End of the repeated word
+          resume = 0;
+          continue;
+        }
+      } else if (c == M_END) {
         break;
+      } else if (c == M_REP) {
+        resume = rpos;
+        rep = TRUE;
+        bitseek (word1);
+        continue;
+      } else if (c == C_SPACE) {
+        if (!rep) word1 = word2;
+        rep = FALSE;
+        word2 = rpos;
+      }
+      if (c >= M_WORD) wordplay (c); else yackchar (c);
     }
-    
-    // Replay the message
-    for (n = 0; (c = rambuffer[n]) && (n < RBSIZE); n++) 
-      // Read until end of message
-      yackchar (c); // play it back 
   }
 }
 
@@ -1020,14 +2992,201 @@ byte yackiambic (byte ctrl)
 #else
 word yackiambic (byte ctrl)
 #endif
+/*! 
+ @brief     Fetches the character recognized by the keyer
+ 
+ The keyer FSM runs in the heartbeat interrupt. This routine tells it
+ whether word ends are to be recognized and returns the character it
+ decoded since the last call, if any. It is typically called once per
+ yackbeat.
+ 
+ @param ctrl    ON if the keyer should recognize when a word ends. OFF if not.
+ @return        The character if one was recognized, /0 if not
+ 
+ */
+{
+#if (NFIB == 13)
+  byte c;
+#else
+  word c;
+#endif
+
+  fsmctrl = ctrl;
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    c = rxchar;
+    rxchar = 0;
+  }
+  return c;
+}
+
+static void setmode (void)
+/*!
+ @brief     Selects the decision routine of the keyer mode in yackflags
+
+ A single mode build has no choice, the mode bits are set to it.
+ */
+{
+#ifdef ONLYMODE
+  yackflags = (yackflags & ~MODE) | ONLYMODE;
+#else
+  DECISION d = (DECISION) halpgmptr (&decisions[(yackflags & MODE) >> 1]);
+
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    decide = d;
+#if MODEIN (STRAIGHT, STRAIGHT)
+    if (skdown && (yackflags & MODE) != STRAIGHT) {
+      skdown = FALSE;           // Do not leave the transmitter keyed
+      yackkey (UP);
+    }
+#endif
+  }
+#endif
+}
+
+// The decision routines. Each is called when an element is due and at
+// least one latch is set or the last decision was on a squeeze. It
+// returns S_DIT or S_DAH, or S_IDLE to end the symbol.
+//   key     DITLATCH and DAHLATCH of the contacts closed since the last
+//           decision
+//   lastkey The latches of the last decision, 0 if the symbol begins
+//   last    The element that was decided then, S_IDLE if none
+
+#if MODEIN (IAMBA, IAMBA)
+static byte iambica (byte key, byte lastkey, byte last)
+/*!
+ @brief     Iambic A: a squeeze alternates dits and dahs
+
+ A paddle released during the element of a squeeze drops its latch, so
+ releasing both ends the symbol with that element.
+ */
+{
+  if (!key) return S_IDLE;
+  if (key == SQUEEZED) return (last == S_DIT) ? S_DAH : S_DIT;
+  return (key & DITLATCH) ? S_DIT : S_DAH;
+}
+#endif
+
+#if MODEIN (IAMBB, IAMBB)
+static byte iambicb (byte key, byte lastkey, byte last)
+/*!
+ @brief     Iambic B: a squeeze alternates dits and dahs
+
+ The latch of a squeeze is kept through its element, so releasing the
+ paddles during it still gives the alternate element after it.
+ */
+{
+  if (key == SQUEEZED || lastkey == SQUEEZED)
+    return (last == S_DIT) ? S_DAH : S_DIT;
+  return (key & DITLATCH) ? S_DIT : S_DAH;
+}
+#endif
+
+#if MODEIN (ULTIM, ULTIM)
+static byte ultimatic (byte key, byte lastkey, byte last)
+/*!
+ @brief     Ultimatic: during a squeeze the paddle closed last wins
+ */
+{
+  if (!key) return S_IDLE;
+  if (key == SQUEEZED) {
+    if (lastkey == DITLATCH) return S_DAH;
+    if (lastkey == DAHLATCH) return S_DIT;
+    if (last != S_IDLE) return last;
+  }
+  return (key & DITLATCH) ? S_DIT : S_DAH;
+}
+#endif
+
+#if MODEIN (DITPR, STRAIGHT)
+static byte ditfirst (byte key, byte lastkey, byte last)
+/*!
+ @brief     Dit priority: a squeeze gives dits
+ */
+{
+  if (!key) return S_IDLE;
+  return (key & DITLATCH) ? S_DIT : S_DAH;
+}
+#endif
+
+#if MODEIN (DAHPR, DAHPR)
+static byte dahfirst (byte key, byte lastkey, byte last)
+/*!
+ @brief     Dah priority: a squeeze gives dahs
+ */
+{
+  if (!key) return S_IDLE;
+  return (key & DAHLATCH) ? S_DAH : S_DIT;
+}
+#endif
+
+#if MODEIN (DACTYL, DACTYL)
+static byte dactylic (byte key, byte lastkey, byte last)
+/*!
+ @brief     Dactylic: keeping the paddle gives a dit, moving it a dah
+
+ The first element of a symbol is chosen as with dit priority.
+ */
+{
+  if (!key) return S_IDLE;
+  if (lastkey == 0) return (key & DITLATCH) ? S_DIT : S_DAH;
+  return (lastkey == key) ? S_DIT : S_DAH;
+}
+#endif
+
+#ifdef HOST
+byte yackdecide (byte mode, byte key, byte lastkey, byte last)
+/*!
+ @brief     Decides an element as the keyer would in a mode
+
+ Only in the host build, for tools that work out the paddle movements
+ without running the FSM. A single mode build decides in its own mode.
+
+ @param mode    The keyer mode, IAMBA to DACTYL
+ @param key     DITLATCH and DAHLATCH of the contacts closed
+ @param lastkey The latches of the last decision, 0 if the symbol begins
+ @param last    DITLATCH or DAHLATCH for the element decided then, 0 if none
+ @return        DITLATCH for a dit, DAHLATCH for a dah, 0 if the symbol ends
+ */
+{
+  byte s = (last == DITLATCH) ? S_DIT : (last == DAHLATCH) ? S_DAH : S_IDLE;
+
+#ifdef ONLYMODE
+  s = decide (key, lastkey, s);
+#else
+  s = ((DECISION) halpgmptr (&decisions[(mode & MODE) >> 1])) (key, lastkey, s);
+#endif
+  return (s == S_DIT) ? DITLATCH : (s == S_DAH) ? DAHLATCH : 0;
+}
+
+void yackoplearn (byte on)
+/*!
+ @brief     Lets the decoders learn the operator timing, or not
+
+ Only in the host build, to compare the decoders with the nominal
+ timing. The averages start over from the set speed.
+
+ @param on      TRUE to learn, FALSE to keep the nominal timing
+ */
+{
+  ATOMIC_BLOCK (ATOMIC_RESTORESTATE) {
+    oplearn = on;
+    opinit ();
+  }
+}
+#endif
+
+#if (NFIB == 13)
+static byte keyfsm (byte ctrl)
+#else
+static word keyfsm (byte ctrl)
+#endif
 /*! 
  @brief     Finite state machine for the keyer
  
- This routine, which usually terminates immediately needs to be called
- in regular intervals of YACKBEAT milliseconds.
+ This routine, which usually terminates immediately is called from
+ the heartbeat interrupt in regular intervals of YACKBEAT milliseconds.
  
- This can happen though an outside busy waiting loop or a counter
- mechanism.
+ This is a private function.
  
  @param ctrl    ON if the keyer should recognize when a word ends. OFF if not.
  @return        The character if one was recognized, /0 if not
@@ -1039,8 +3198,10 @@ word yackiambic (byte ctrl)
   static word idletimer = 0;        // A timer incremented in S_IDLE
   static byte lastkey = 0;          // The last key pressed
   static byte bcntr   = 0;          // Number of elements sent
-  static byte prelatch = 0;
-  const byte mode = yackflags & MODE;
+  static word prelatch = 0;         // Early latch interval, in timer1 counts
+  static word gap = 0;              // Inter-element gap of the element
+  word cutoff;                      // End of the latch interval
+  byte n;
 #if (NFIB == 13)
   static byte buffer  = 1;          // A place to store the character
   byte retchar = 0;   // character in Fibonacci coding
@@ -1068,7 +3229,8 @@ word yackiambic (byte ctrl)
   if (timer > 0) timer--;           // Count down
 
 #ifdef POWERSAVE            
-  yackpower (state == S_IDLE); // OK to go to sleep when S_IDLE
+  yackpower (state == S_IDLE && !txactive && txhead == txtail
+             && SKIDLE && SERIALIDLE && TELIDLE); // OK to go to sleep when S_IDLE
 #endif
 
   // The following handles the inter-character gap. When there are
@@ -1168,39 +3330,100 @@ word yackiambic (byte ctrl)
    * --+          +----+          +---------------+---
    */
 
-  if (timer >= prelatch) keylatch (lastkey);
+  // The paddles are latched until prelatch before the decision taken
+  // when the timer expires. With the edge timestamps this is exact to
+  // a timer1 count. Far from the decision every edge so far counts.
+
+  if (timer > PREBEATS) {
+    cutoff = tickbase + BEATCNT;
+  } else {
+    cutoff = tickbase - prelatch;
+    for (n = timer; n > 0; n--) cutoff += BEATCNT;
+  }
+#if MODEIN (STRAIGHT, STRAIGHT)
+  if ((yackflags & MODE) == STRAIGHT) {
+    latches = 0;                // Only the queued output, see skedge
+    edgelost = TRUE;            // The port is read on a mode change
+  } else
+#endif
+  keylatch (lastkey, cutoff);
+
+  // The paddle does not wait for the character gap of queued output,
+  // the gap after the last element is kept already
+  if (txactive && state == S_IDLE && (latches & SQUEEZED)) timer = 0;
            
   if (timer == 0) {
     if (state == S_IDLE) {
       if (bcntr > 0) {
         retchar = (buffer < f[NFIB-1]) ? buffer : 0;
+#ifdef TELEMETRY
+        telpush (retchar, 0);
+#endif
         bcntr = 0;
         buffer = C_SPACE;
-      } else if (ctrl && idletimer == IWGLEN * wpmcnt) {
+      } else if (ctrl && idletimer == opcut (OP_PCHAR)) {
         retchar = C_SPACE;
       };
-#if (NFIB == 13)
-      if (idletimer < MAX_BYTE) idletimer++;
-#else
       if (idletimer < MAX_WORD) idletimer++;
-#endif
     }
 
     // Now evaluate the latch and determine what to send next
-    byte key = volflags & SQUEEZED;
+    byte key = latches & SQUEEZED;
     prelatch = prelatch/2;
-    if (key > 0) {
-      if (mode == IAMBA && key == SQUEEZED) {
-        state = (state == S_DIT) ? S_DAH : S_DIT;
-      } else if ((((lastkey == 0) || (mode != DACTYL)) 
-            && (key & DITLATCH)) 
-           || ((mode == DACTYL) && (lastkey == key))) {
-        state = S_DIT;
-      } else {
-        state = S_DAH;
+
+    // A paddle touched while queued output is sent breaks in. If the
+    // character is not complete, its gap is sent first and the latches
+    // are kept for the decision after it. Typed ahead serial input is
+    // dropped by the paddle also when it waits.
+    
+    if (key > 0 && txactive) {
+      txclear ();
+      txbreak = TRUE;
+      if (state != S_IDLE) key = 0;
+    }
+#ifdef SERIAL
+    if (key > 0) sertail = serhead;
+#endif
+
+    // Queued output is fetched once the previous character and its gap
+    // are complete. A word space only extends the gap.
+    
+    if (key == 0 && txbits <= 1 && state == S_IDLE) {
+      byte c = 0;
+      
+      if (txhead != txtail) {
+        c = txqueue[txtail];
+        txtail = (txtail + 1) & (TXQ - 1);
+#ifdef SERIAL
+      } else if (serhead != sertail) {
+        c = serq[sertail];
+        sertail = (sertail + 1) & (SERQ - 1);
+#endif
+      }
+      txactive = (c != 0);
+      if (c == C_SPACE) 
+        timer = pace (IWGLEN, TRUE);
+      else if (c)
+        txbits = yackelements (c);
+    }
+    
+    // Iambic B may add an element after a squeeze with no latch set
+    byte next = S_IDLE;
+    if (key > 0 || lastkey == SQUEEZED) next = decide (key, lastkey, state);
+
+    if (next != S_IDLE) {
+      if (state == S_IDLE && idletimer >= opcut (OP_PCHAR))
+        optrack (OP_PWORD, idletimer); // The pause ended a word
+#ifdef STATS
+      if (state == S_IDLE) {    // First element, keyed right below
+        uint32_t cyc = (uint32_t) (word) (tickbase + halsubbeat () - lastclose)
+                       * CNTCYC;
+        if (cyc > MAX_WORD) cyc = MAX_WORD;  // Held at the top, not wrapped
+        if (cyc > stats[ST_LATENCY]) stats[ST_LATENCY] = cyc;
       }
+#endif
+      state = next;
       if (state == S_DIT) {
-        timer = DITLEN * wpmcnt;
         if (bcntr < NFIB-2) buffer += f[bcntr++];
 #if (NFIB == 13)
         else buffer = MAX_BYTE;
@@ -1208,8 +3431,7 @@ word yackiambic (byte ctrl)
         else buffer = MAX_WORD;
 #endif
       }  else  {
-        prelatch = DITLEN/2;
-        timer = DAHLEN * wpmcnt;
+        prelatch = PRELATCH;
         if (bcntr < NFIB-3) {
           buffer += f[++bcntr];
           buffer += f[++bcntr];
@@ -1219,15 +3441,46 @@ word yackiambic (byte ctrl)
         } else buffer = MAX_WORD;
 #endif
       }
-      yackkey (DOWN);
+    } else if (txbits > 1) {
+      // Next element of the queued character, not decoded
+      state  = (txbits & 1) ? S_DAH : S_DIT;
+      txbits >>= 1;
     } else {
       prelatch = 0;
-      if (state != S_IDLE) timer = ICGLEN * wpmcnt;
+      if (state != S_IDLE) timer = pace (ICGLEN, TRUE);
       state = S_IDLE;
     }
+
+    if (state != S_IDLE) {
+      // Key the element, the gap after it is included in its length
+      n = (state == S_DAH) ? DAHLEN : DITLEN;
+      gap = pace (IEGLEN, FALSE);
+      timer = pace (n - IEGLEN, FALSE) + gap;
+      idletimer = 0;
+      yackkey (DOWN);
+#ifdef TELEMETRY
+      if (next != S_IDLE) telpush (telspc, timer - gap);
+      telspc = 0;
+#endif
+    }
     lastkey = key;
   } 
-  if (timer <= IEGLEN * wpmcnt) yackkey (UP);
+  if (timer <= gap && !SKDOWN) yackkey (UP);
+#ifdef TELEMETRY
+  if ((state == S_IDLE || timer <= gap) && !SKDOWN) telcount (1);
+#endif
+  keying = (state != S_IDLE);
+
+  // Nothing is due but the next paddle edge. If the foreground allows
+  // it, the heartbeat slows down until a pin change or the foreground
+  // speeds it up again.
+
+  if (slowok && state == S_IDLE && timer == 0 && idletimer > opcut (OP_PCHAR)
+      && !latches && edgehead == edgetail && !txactive && txhead == txtail
+      && !ckbounce && SKIDLE && SERIALIDLE && TELIDLE) {
+    slow = TRUE;
+    halbeatslow ();
+  }
 
   return retchar; // Nothing to return if not returned above
   
@@ -53,7 +53,9 @@
 // Definition of the yackflags variable. These settings get stored in
 // EEPROM when changed.
 
-#define NFIB 13
+#ifndef NFIB
+#define NFIB 13        // 13 for byte sized character codes, 24 for word sized
+#endif
 
 #define CONFLOCK    0b00000001  // Configuration locked down
 #define MODE        0b00001110  // 3 bits to define keyer mode (see next section)
@@ -67,17 +69,26 @@
 #define ULTIM       0b00000100  // Ultimatic Mode
 #define DITPR       0b00001000  // Always give DIT priority
 #define DAHPR       0b00001010  // Always give DAH priority
+#define STRAIGHT    0b00001100  // Straight key on the dit contact
 #define DACTYL      0b00001110  // Dactylic mode
 
+#ifndef FLAGDEFAULT
 #define FLAGDEFAULT DACTYL | TXKEY | SIDETONE
+#endif
+
+// A keyer built for a single mode leaves out the code of the others and
+// ignores mode changes
+// #define ONLYMODE DACTYL   // Uncomment this line for dactylic mode only
 
 // Definition of volflags variable. These flags do not get stored in EEPROM.
+// The two latch bits are kept separately by the keyer FSM, which runs in
+// the heartbeat interrupt.
 #define DITLATCH    0b00000001  // Set if DIT contact was closed
 #define DAHLATCH    0b00000010  // Set if DAH contact was closed
 #define SQUEEZED    0b00000011  // DIT and DAH = squeezed
 #define DIRTYFLAG   0b00000100  // Set if cfg data was changed and needs storing
-#define CKLATCH     0b00001000  // Set if the command key was pressed at some point
 #define VSCOPY      0b00110000  // Copies of Sidetone and TX flags from yackflags
+#define FGKEY       0b01000000  // Set while the foreground keys, FSM paused
 
 // The following defines timing constants. In the default version the
 // keyer is set to operate in 10 ms heartbeat intervals. If a higher
@@ -87,20 +98,73 @@
 #define YACKBEAT    10
 #define YACKSECS(n) (n*(10000/YACKBEAT)) // Beats in n seconds
 #define YACKMS(n)   (n*(10/YACKBEAT))    // Beats in n ms
-#define YACKCNTS   2                     // counts number of samples to
-					 // swap dit/dah
+
+// Paddle edges are timestamped in timer1 counts, 8 us at 1 MHz
+#define BEATCNT    125                   // Timer1 counts per beat
+#define DEBOUNCE   (2*BEATCNT)           // Contact bounce lockout after an
+					 // accepted edge (2 ms)
+#define PRELATCH   (DITLEN/2*BEATCNT)    // Early latch interval after a
+					 // dah, halved after each element
+#define PREBEATS   (PRELATCH/BEATCNT+2)  // Beats before a decision where
+					 // the latch cutoff is tracked
+#define SLOWBEAT   8                     // Heartbeat of 2^SLOWBEAT ms while
+					 // the keyer waits for the paddle
+
+// Command button, debounced in the heartbeat interrupt
+#define CKDEBOUNCE 10    // Button changes must last this long (ms)
+#define CKHOLDTIME  1    // A press this long is a hold, not a click (s)
+#define CKRATE      4    // Speed steps per second with button and paddle
+
+#define CKCLICK     1    // yackctrlkey: the button was pressed and released
+#define CKHOLD      2    // and it was held for CKHOLDTIME
 
 // Power save mode
 #define POWERSAVE    // Comment this line if no power save mode required
 #define PSTIME 30    // 30 seconds until automatic powerdown
 #define PWRWAKE ((1<<PCINT3) | (1<<PCINT4) | (1<<PCINT2)) // Dit, Dah or Command wakes us up..
+#define EDGEPINS ((1<<PCINT3) | (1<<PCINT4)) // Dit and Dah edges are captured
+
+// Serial input for sending typed text, 8N1 at logic levels (idle high)
+// as from a USB serial adapter. RXPIN is the reset pin of the ATtiny45.
+// To use it the RSTDISBL fuse must be programmed, after which the chip
+// can only be reprogrammed by a high voltage programmer. The simulator
+// is always built with serial input.
+// #define SERIAL   // Uncomment this line for serial input
+#define RXPIN    5
+#define BAUD  1200
+#define BITCNT ((BEATCNT*1000L + BAUD/2) / BAUD) // Timer1 counts per bit
+
+// Telemetry of the paddle keying on the same pin, 8N1 at BAUD. With the
+// serial input too the line is half duplex: the adapter drives it
+// through a resistor, which our output overrides. One line of text per
+// character, see README.md. The simulator is always built with it.
+// #define TELEMETRY   // Uncomment this line for telemetry
+
+// Counters of the hot path, read out with C in command mode in the
+// order below. They count from power up and stop at 65535. The
+// simulator is always built with them.
+// #define STATS       // Uncomment this line for the counters
+#define ST_OVERRUN  0  // Heartbeats whose interrupt ran into the next one
+#define ST_BEATCYC  1  // Most CPU cycles from a heartbeat to the end of
+                       // its interrupt
+#define ST_EEWRITE  2  // EEPROM bytes written
+#define ST_POWER    3  // Power downs
+#define ST_LATENCY  4  // Most CPU cycles from a paddle closure to the key
+                       // down of the first element it started
+#define NSTATS      5
+#define CNTCYC      8  // CPU cycles per timer1 count
+
+// Stack check. The RAM above the static data is painted at startup and
+// H in command mode sends how many bytes of it the stack never reached.
+// Only on the chip, the simulator has no stack to measure.
+// #define STACKCHECK  // Uncomment this line for the stack check
+#define STACKPAINT  0xc5
 
 // These values limit the speed that the keyer can be set to
 #define MAXWPM 50  
 #define MINWPM  6
 #define DEFWPM 15
 
-#define WPMCALC(n) ((12000/YACKBEAT)/n) // Calculates number of beats in a dot 
 
 #define IEGLEN 1  // Length of a inter-element gap, which is included in
 		  // DITLEN and DAHLEN
@@ -109,6 +173,11 @@
 #define ICGLEN 2  // Length of inter-character gap
 #define IWGLEN 4  // Additional Length of inter-word gap
 
+// The decoders follow the operator's timing with running averages,
+// which start from the nominal lengths at the set speed and move
+// 1/2^OPRATE of the way with each element or gap
+#define OPRATE 3
+
 // Duration of various internal timings in seconds
 #define TUNEDURATION 20  // Duration of tuning keydown (in seconds)
 #define DEFTIMEOUT    5  // Default timeout 5 seconds
@@ -132,9 +201,10 @@
 #define DEFCTC  CTCVAL(DEFFREQ)
 
 // The following are various definitions in use throughout the program
-#define RBSIZE 100     // Size of each of the two EEPROM buffers
+#define MACROS    9    // Number of messages, recorded as 1 to 9
+#define MACROSIZE 182  // EEPROM shared by the messages
 
-#define MAGPAT 0xa5    // If this number is found in EEPROM, content assumed valid
+#define JSLOTS 7       // Settings journal records, each save uses the next
 
 #define SPC    3
 #define DIT    1
@@ -212,6 +282,8 @@
 #define SETBIT(ADDRESS,BIT)     (ADDRESS |= (1<<BIT))
 #define CLEARBIT(ADDRESS,BIT)   (ADDRESS &= ~(1<<BIT))
 
+#include <stdint.h>
+
 typedef uint8_t  byte;
 typedef uint16_t word;
 
@@ -221,6 +293,7 @@ typedef uint16_t word;
 // Forward declarations of public functions
 void yackinit (void);
 void yackchar (byte c);
+void yackflush (void);
 void yackstring (const byte *p);
 #if (NFIB == 13)
 byte yackiambic (byte ctrl);
@@ -234,7 +307,12 @@ void yackinhibit (uint8_t mode);
 void yacktoggle (byte flag);
 byte yackflag (byte flag);
 void yackbeat (void);
+void yackidle (void);
+word yacktime (void);
 void yackmessage (byte function, byte msgnr);
+word yackstore (byte msgnr, const byte *p);
+word yackelements (byte c);
+byte yackascii (char a);
 void yacksave (void);
 byte yackctrlkey (byte mode);
 void yackreset (void);
@@ -244,7 +322,22 @@ word yackwpm (void);
 void yackplay (byte i);
 void yackdel (byte n);
 void yackspeed (byte dir);
+byte yackfarns (byte n);
 
 #ifdef POWERSAVE
 void yackpower (byte n);
+void yackwake (word ms);
+#endif
+
+#ifdef STATS
+word yackstat (byte n);
+#endif
+
+#ifdef STACKCHECK
+word yackstack (void);
+#endif
+
+#ifdef HOST
+byte yackdecide (byte mode, byte key, byte lastkey, byte last);
+void yackoplearn (byte on);
 #endif
@@ -0,0 +1,300 @@
+/*!
+
+ @file      yackbench.c
+ @brief     Cycles per heartbeat of the firmware, run in simavr
+ @author    Anders Helmersson, SM5KAE
+
+ Runs the firmware (main.elf) on the simulated ATtiny of simavr and
+ measures the CPU time of every heartbeat: the cycles from the entry
+ of the heartbeat interrupt until the CPU goes back to sleep. That is
+ the keyer FSM in the interrupt plus whatever the foreground does
+ before it waits for the next beat. A beat whose interrupt comes
+ before the CPU slept is an overrun and counts as ending there.
+
+ Usage: yackbench [-b budget] elf [script]
+
+ The paddles and the button follow the stimulus script (default stdin)
+ in the format of yackhost.c. Serial input is not supported. The
+ minimum, average and maximum cycles per beat are printed, and the exit
+ status is 1 if any beat took more than budget cycles (default BUDGET,
+ the 1 ms heartbeat at 1 MHz) or overran.
+
+ The pin change interrupt is timed the same way, from its vector to
+ its reti, and held to the same budget. It timestamps the paddle edges
+ and keys the straight key, mostly while the CPU sleeps, so the beats
+ do not include it. Before the run both vectors are checked against
+ the handlers in the symbols of the ELF file.
+
+ See the bench target of the Makefile, which builds the firmware once
+ for each keyer mode.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ @date      2025-03-01  - Created
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gelf.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/avr_ioport.h>
+#include "yack.h"
+
+#define BUDGET     1000   // Default budget per beat (cycles)
+#define BEATVECT   6      // Byte address of the TIMER1_COMPA vector
+#define BEATISR    "__vector_3"  // The handler it jumps to
+#define EDGEVECT   4      // Byte address of the PCINT0 vector
+#define EDGEISR    "__vector_2"
+#define RETI       0x9518 // Opcode that ends an interrupt
+#define BENCHTAIL  60000  // Run this long after the last stimulus (ms)
+
+typedef struct {
+  avr_cycle_count_t min, max;
+  avr_cycle_count_t maxat;             // Start of the longest one
+  unsigned long long sum;
+  unsigned long n;
+} TIMING;
+
+static avr_t *avr;
+
+static TIMING beat = {~(avr_cycle_count_t) 0, 0, 0, 0, 0};
+static TIMING edge = {~(avr_cycle_count_t) 0, 0, 0, 0, 0};
+static unsigned long overruns = 0;
+
+static void setpins (const char *what)
+/*!
+ @brief     Opens and closes the contacts as given in a script line
+ */
+{
+  byte closed = 0;
+  byte pin;
+
+  for (; *what; what++) {
+    switch (*what) {
+      case '.': closed |= (1 << DITPIN); break;
+      case '-': closed |= (1 << DAHPIN); break;
+      case 'c': closed |= (1 << BTNPIN); break;
+    }
+  }
+  for (pin = 0; pin < 8; pin++)
+    if ((1 << pin) & ((1 << DITPIN) | (1 << DAHPIN) | (1 << BTNPIN)))
+      avr_raise_irq (avr_io_getirq (avr, AVR_IOCTL_IOPORT_GETIRQ ('B'), pin),
+                     !(closed & (1 << pin)));
+}
+
+static unsigned long symbol (const char *file, const char *name)
+/*!
+ @brief     Looks up a symbol of the firmware
+
+ @param file   The ELF file
+ @param name   The symbol
+ @return       Its value, 0 if it is not there
+ */
+{
+  unsigned long v = 0;
+  Elf *e;
+  Elf_Scn *scn = NULL;
+  Elf_Data *d;
+  GElf_Shdr sh;
+  GElf_Sym sym;
+  const char *s;
+  size_t i;
+  int fd;
+
+  if (elf_version (EV_CURRENT) == EV_NONE || (fd = open (file, O_RDONLY)) < 0)
+    return 0;
+  if ((e = elf_begin (fd, ELF_C_READ, NULL))) {
+    while (!v && (scn = elf_nextscn (e, scn))) {
+      if (!gelf_getshdr (scn, &sh) || sh.sh_type != SHT_SYMTAB
+          || !(d = elf_getdata (scn, NULL)))
+        continue;
+      for (i = 0; !v && i < sh.sh_size / sh.sh_entsize; i++) {
+        if (gelf_getsym (d, i, &sym) && (s = elf_strptr (e, sh.sh_link,
+            sym.st_name)) && strcmp (s, name) == 0)
+          v = sym.st_value;
+      }
+    }
+    elf_end (e);
+  }
+  close (fd);
+  return v;
+}
+
+static int vector (const char *file, unsigned vect, const char *name)
+/*!
+ @brief     Checks that a vector jumps to its handler
+
+ The vector table of the ATtiny holds an rjmp per interrupt. The one
+ at vect must reach the handler as the linker placed it.
+
+ @param file   The ELF file, loaded into avr
+ @param vect   Byte address of the vector
+ @param name   Symbol of the handler
+ @return       TRUE if it does
+ */
+{
+  unsigned long isr = symbol (file, name);
+  unsigned op = avr->flash[vect] | (avr->flash[vect + 1] << 8);
+  int k = (op & 0x800) ? (int) (op & 0xfff) - 0x1000 : (int) (op & 0xfff);
+
+  if (isr && (op & 0xf000) == 0xc000            // An rjmp
+      && (((vect / 2 + 1 + k) * 2) & avr->flashend) == isr)
+    return TRUE;
+  fprintf (stderr, "%s: the vector at %u does not reach %s\n", file, vect,
+           name);
+  return FALSE;
+}
+
+static avr_cycle_count_t nextline (FILE *f, char *what,
+                                   avr_cycle_count_t *end)
+/*!
+ @brief     Reads the next stimulus of the script
+
+ @param what   The contacts closed from then on, "end" at the end
+ @param end    Set to the cycle the run ends at
+ @return       Cycle of the stimulus
+ */
+{
+  char line[120];
+  unsigned long ms;
+
+  while (f && fgets (line, sizeof (line), f)) {
+    if (line[0] == '#' || sscanf (line, "%lu %39s", &ms, what) != 2)
+      continue;
+    if (strcmp (what, "ser") == 0) {
+      fprintf (stderr, "serial input is not supported\n");
+      exit (2);
+    }
+    *end = (avr_cycle_count_t) (ms + (strcmp (what, "end") ? BENCHTAIL : 0))
+           * (F_CPU / 1000);
+    return (avr_cycle_count_t) ms * (F_CPU / 1000);
+  }
+  strcpy (what, "end");
+  return *end;
+}
+
+static void account (TIMING *t, avr_cycle_count_t start,
+                     avr_cycle_count_t now)
+/*!
+ @brief     Adds a beat or a pin change to the statistics
+ */
+{
+  avr_cycle_count_t c = now - start;
+
+  if (c < t->min) t->min = c;
+  if (c > t->max) {
+    t->max = c;
+    t->maxat = start;
+  }
+  t->sum += c;
+  t->n++;
+}
+
+static void report (const char *what, TIMING *t)
+/*!
+ @brief     Prints the statistics of a beat or a pin change
+ */
+{
+  printf ("%lu %s, cycles min %lu avg %.1f max %lu at %.3f s", t->n, what,
+          (unsigned long) t->min, t->n ? (double) t->sum / t->n : 0.0,
+          (unsigned long) t->max, (double) t->maxat / F_CPU);
+}
+
+int main (int argc, char *argv[])
+{
+  elf_firmware_t fw;
+  FILE *f = stdin;
+  char what[40];
+  unsigned long budget = BUDGET;
+  avr_cycle_count_t next, end = 0, start = 0, estart = 0;
+  byte inbeat = FALSE, inedge = FALSE, ret = FALSE;
+  int state, a = 1;
+
+  if (argc > 2 && strcmp (argv[1], "-b") == 0) {
+    budget = strtoul (argv[2], NULL, 0);
+    a += 2;
+  }
+  if (argc <= a || argc > a + 2) {
+    fprintf (stderr, "usage: yackbench [-b budget] elf [script]\n");
+    return 2;
+  }
+  if (argc > a + 1 && !(f = fopen (argv[a + 1], "r"))) {
+    perror (argv[a + 1]);
+    return 2;
+  }
+
+  memset (&fw, 0, sizeof (fw));
+  if (elf_read_firmware (argv[a], &fw)) {
+    fprintf (stderr, "%s: cannot read firmware\n", argv[a]);
+    return 2;
+  }
+  if (!(avr = avr_make_mcu_by_name ("attiny45"))) return 2;
+  avr_init (avr);
+  avr_load_firmware (avr, &fw);
+  avr->frequency = F_CPU;
+  if (!vector (argv[a], BEATVECT, BEATISR)
+      || !vector (argv[a], EDGEVECT, EDGEISR))
+    return 2;
+
+  setpins ("");                       // Open contacts, as the pullups do
+  next = nextline (f, what, &end);
+
+  while (TRUE) {
+    state = avr_run (avr);
+    if (state == cpu_Done || state == cpu_Crashed) {
+      fprintf (stderr, "firmware stopped at %04x\n", (unsigned) avr->pc);
+      return 2;
+    }
+
+    if (ret) {                        // The pin change returned
+      account (&edge, estart, avr->cycle);
+      inedge = ret = FALSE;
+    }
+
+    if (avr->pc == BEATVECT) {        // Heartbeat interrupt taken
+      if (inbeat) {
+        account (&beat, start, avr->cycle);
+        overruns++;
+      }
+      inbeat = TRUE;
+      start = avr->cycle;
+    } else if (avr->pc == EDGEVECT) { // Pin change interrupt taken
+      inedge = TRUE;
+      estart = avr->cycle;
+    } else if (inedge && (avr->flash[avr->pc]
+                          | (avr->flash[avr->pc + 1] << 8)) == RETI) {
+      ret = TRUE;                     // Counted once it is executed
+    } else if (inbeat && avr->state == cpu_Sleeping) {
+      account (&beat, start, avr->cycle);
+      inbeat = FALSE;
+    }
+
+    if (avr->cycle >= next) {
+      if (strcmp (what, "end") == 0) break;
+      setpins (what);
+      next = nextline (f, what, &end);
+    }
+  }
+
+  if (!beat.n) {
+    fprintf (stderr, "no heartbeats\n");
+    return 2;
+  }
+  report ("beats", &beat);
+  printf (", %lu overruns\n", overruns);
+  report ("pin changes", &edge);
+  printf ("\n");
+  if (beat.max > budget || edge.max > budget || overruns) {
+    printf ("over the budget of %lu cycles\n", budget);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,236 @@
+/*!
+
+ @file      yackcorpus.c
+ @brief     Paddle movements and keying time of a text in each keyer mode
+ @author    Anders Helmersson, SM5KAE
+
+ Reads text, such as QSO logs, and reports for each keyer mode how
+ many times the paddle is moved, how many elements are keyed with both
+ paddles squeezed, and how long the keying takes, per character and per
+ word.
+
+ Usage: yackcorpus [-v] [file ...]
+
+ The files (default stdin) are read as one text. A character is taken
+ as Morse if yackascii has a code for it, anything else separates the
+ words. With -v the moves and squeezes of every character found are
+ listed as well, for working on the rules of a mode.
+
+ The paddle plan of each character code is worked out once per mode
+ from yackelements and the decision routines of yack.c: the paddle
+ position (dit, dah or squeezed) held at each decision, with as few
+ moves as possible and then as few squeezes. A move is a change of
+ the position, releasing the paddle after the character included. The
+ straight key moves twice per element. The text itself is only counted
+ per byte, so it is read as fast as it comes in.
+
+ Iambic B keys one more element after a squeeze released during its
+ element, so there the paddle may already be released at a decision.
+ The keying time, in dits with the gaps, does not depend on the mode.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ @date      2025-03-01  - Created
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "yack.h"
+
+#define BLOCK   (1 << 20)  // Bytes read at a time
+#define NOPLAN  255        // Moves of a character a mode cannot key
+
+static const byte modes[] = {IAMBA, IAMBB, ULTIM, DITPR, DAHPR, STRAIGHT,
+  DACTYL};
+#define NMODES  (sizeof (modes))
+
+static const char *modename[] = {"IAMBA", "IAMBB", "ULTIM", "?", "DITPR",
+  "DAHPR", "STRAIGHT", "DACTYL"};
+
+static byte moves[NMODES][256];    // Per mode and character code
+static byte squeezes[NMODES][256];
+static byte dits[256];             // Keying time, with the character gap
+static byte code[256];             // Character code of each byte
+
+static void plan (byte m, byte c)
+/*!
+ @brief     Works out the fewest paddle moves that key a character
+
+ A dynamic program over the elements, with the position held at the
+ last decision as the state: that is also the lastkey of the next one.
+
+ @param m   Index into modes
+ @param c   The character code
+ */
+{
+  word e = yackelements (c);
+  word cost[4], next[4];           // Moves * 16 + squeezes, per position
+  byte last = 0;                   // Element decided last, 0 if none
+  byte k, p, el;
+
+  dits[c] = ICGLEN;
+  for (k = 0; k < 4; k++) cost[k] = MAX_WORD;
+  cost[0] = 0;
+
+  for (; e > 1; e >>= 1) {
+    el = (e & 1) ? DAHLATCH : DITLATCH;
+    dits[c] += (el == DAHLATCH) ? DAHLEN : DITLEN;
+
+    for (k = 0; k < 4; k++) next[k] = MAX_WORD;
+    for (k = 0; k <= SQUEEZED; k++) {
+      for (p = 0; p < 4; p++) {
+        word w;
+
+        if (cost[p] == MAX_WORD || (k == 0 && p != SQUEEZED)
+            || yackdecide (modes[m], k, p, last) != el)
+          continue;
+        w = cost[p] + ((k != p) ? 16 : 0) + ((k == SQUEEZED) ? 1 : 0);
+        if (w < next[k]) next[k] = w;
+      }
+    }
+    memcpy (cost, next, sizeof (cost));
+    last = el;
+  }
+
+  // Released after the last element, if not before it
+  for (k = 1; k < 4; k++)
+    if (cost[k] != MAX_WORD) cost[k] += 16;
+
+  for (k = 1; k < 4; k++)
+    if (cost[k] < cost[0]) cost[0] = cost[k];
+  moves[m][c]    = (cost[0] == MAX_WORD) ? NOPLAN : cost[0] >> 4;
+  squeezes[m][c] = cost[0] & 15;
+}
+
+static void tables (void)
+/*!
+ @brief     Sets up the tables of all character codes and bytes
+ */
+{
+  word c;
+  byte m, n;
+
+  for (c = 1; c < 256; c++) {
+    for (m = 0; m < NMODES; m++) {
+      if (modes[m] == STRAIGHT) continue;
+      plan (m, c);
+    }
+    for (m = 0; m < NMODES; m++) {
+      if (modes[m] != STRAIGHT) continue;
+      for (n = 0; yackelements (c) >> (n + 1); n++) ;
+      moves[m][c] = 2 * n;
+      squeezes[m][c] = 0;
+    }
+  }
+  for (c = 0; c < 256; c++) {
+    code[c] = yackascii ((char) c);
+    if (code[c] == C_SPACE) code[c] = 0;
+  }
+}
+
+int main (int argc, char *argv[])
+{
+  static byte buf[BLOCK];
+  unsigned long long count[4][256];  // Bytes, four ways against stalls
+  unsigned long long total[256];
+  unsigned long long bytes = 0, words = 0, chars = 0, skipped;
+  unsigned long long mv, sq, dt;
+  byte isch[256];                    // 1 for a Morse character
+  byte inword = 0;
+  struct timespec t0, t1;
+  double secs;
+  int verbose = 0, a = 1, c, m;
+  size_t n, i;
+
+  if (argc > 1 && strcmp (argv[1], "-v") == 0) {
+    verbose = 1;
+    a++;
+  }
+
+  tables ();
+  for (c = 0; c < 256; c++) isch[c] = (code[c] != 0);
+  memset (count, 0, sizeof (count));
+
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  do {
+    FILE *f = stdin;
+
+    if (a < argc && !(f = fopen (argv[a], "rb"))) {
+      perror (argv[a]);
+      return 1;
+    }
+    inword = 0;
+    while ((n = fread (buf, 1, BLOCK, f)) > 0) {
+      for (i = 0; i + 4 <= n; i += 4) {
+        count[0][buf[i]]++;
+        count[1][buf[i+1]]++;
+        count[2][buf[i+2]]++;
+        count[3][buf[i+3]]++;
+        words += isch[buf[i]]   & !inword;
+        words += isch[buf[i+1]] & !isch[buf[i]];
+        words += isch[buf[i+2]] & !isch[buf[i+1]];
+        words += isch[buf[i+3]] & !isch[buf[i+2]];
+        inword = isch[buf[i+3]];
+      }
+      for (; i < n; i++) {
+        count[0][buf[i]]++;
+        words += isch[buf[i]] & !inword;
+        inword = isch[buf[i]];
+      }
+      bytes += n;
+    }
+    if (f != stdin) fclose (f);
+  } while (++a < argc);
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+  secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+  for (c = 0; c < 256; c++) {
+    total[c] = count[0][c] + count[1][c] + count[2][c] + count[3][c];
+    if (isch[c]) chars += total[c];
+  }
+  skipped = bytes - chars;
+
+  printf ("%llu bytes in %.3f s (%.0f MB/s), %llu characters in %llu "
+          "words, %llu other bytes\n", bytes, secs,
+          secs > 0 ? bytes / secs / 1e6 : 0.0, chars, words, skipped);
+  if (!chars) return 0;
+
+  printf ("mode       moves/char  squeezes/char  dits/char  "
+          "moves/word  squeezes/word  dits/word\n");
+  for (m = 0; m < NMODES; m++) {
+    mv = sq = dt = 0;
+    for (c = 0; c < 256; c++) {
+      if (!isch[c]) continue;
+      mv += total[c] * moves[m][code[c]];
+      sq += total[c] * squeezes[m][code[c]];
+      dt += total[c] * dits[code[c]];
+    }
+    dt += words * IWGLEN;
+    printf ("%-8s %12.3f %14.3f %10.3f %11.3f %14.3f %10.3f\n",
+            modename[modes[m] >> 1], (double) mv / chars,
+            (double) sq / chars, (double) (dt - words * IWGLEN) / chars,
+            (double) mv / words, (double) sq / words, (double) dt / words);
+  }
+
+  if (verbose) {
+    printf ("\nchar       count  dits");
+    for (m = 0; m < NMODES; m++) printf (" %8.8s", modename[modes[m] >> 1]);
+    printf ("   (moves/squeezes)\n");
+    for (c = 0; c < 256; c++) {
+      if (!isch[c] || (c >= 'a' && c <= 'z')) continue;
+      mv = total[c] + ((c >= 'A' && c <= 'Z') ? total[c + 'a' - 'A'] : 0);
+      if (!mv) continue;
+      printf ("%c %14llu %5u", c, mv, dits[code[c]]);
+      for (m = 0; m < NMODES; m++)
+        printf (" %5u/%-2u", moves[m][code[c]], squeezes[m][code[c]]);
+      printf ("\n");
+    }
+  }
+  return 0;
+}
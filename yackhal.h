@@ -0,0 +1,412 @@
+/* ********************************************************************
+ Program  : yackhal.h
+ Author   : Anders Helmersson SM5KAE
+ Purpose  : hardware abstraction layer of the keyer library
+ Created  : 2025-03-01
+
+ The keyer library (yack.c) and the application (main.c) do not touch
+ the AVR registers directly. Instead they use the small set of
+ primitives below: reading the input port, driving the TX line and the
+ sidetone, waiting for the next heartbeat, sleeping and accessing
+ EEPROM. EEPROM is written one byte at a time from the EEPROM ready
+ interrupt, so reads are the only blocking accesses.
+
+ Two backends exist. The default one targets the ATtiny and consists
+ of macros and inline functions which expand to exactly the register
+ accesses the library used to do itself, so the generated code is the
+ same. When compiled with -DHOST the primitives are implemented by
+ yackhost.c which simulates the ports, the EEPROM and a millisecond
+ clock. This allows the keyer to run natively, much faster than real
+ time, see yacksim.c.
+
+ *********************************************************************/
+
+#ifndef YACKHAL_H
+#define YACKHAL_H
+
+#include <stdint.h>
+
+#ifndef HOST
+
+// ***************************************************************************
+// AVR backend
+// ***************************************************************************
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+#define HALISR(vector)      ISR (vector)
+
+// Paints the RAM from the end of the static data (_end) to the top of
+// the stack (__stack) with STACKPAINT. It runs from .init1, before the
+// stack pointer and the zero register are set up, so it is plain
+// assembly. Placed once, in yack.c.
+#define HALSTACKPAINT \
+  void halstackpaint (void) __attribute__ ((naked, used, section (".init1"))); \
+  void halstackpaint (void) \
+  { \
+    __asm volatile ("ldi r30, lo8(_end)\n" \
+                    "ldi r31, hi8(_end)\n" \
+                    "ldi r24, %0\n" \
+                    "ldi r25, hi8(__stack)\n" \
+                    "rjmp 2f\n" \
+                    "1: st Z+, r24\n" \
+                    "2: cpi r30, lo8(__stack)\n" \
+                    "cpc r31, r25\n" \
+                    "brlo 1b\n" \
+                    "breq 1b\n" :: "M" (STACKPAINT)); \
+  }
+
+#define halkeys()           (KEYINP)  // Paddle port, contacts are active low
+#define halbutton()         (BTNINP)  // Command button port, active low
+
+#define haloutset()         SETBIT (OUTPORT, OUTPIN)
+#define haloutclr()         CLEARBIT (OUTPORT, OUTPIN)
+
+#define haldelay(ms)        _delay_ms (ms)
+
+#define halpgmbyte(p)       pgm_read_byte (p)
+#define halpgmptr(p)        pgm_read_ptr (p)
+
+#define haleeread(p)        eeprom_read_byte (p)
+#define haleereadw(p)       eeprom_read_word (p)
+#define haleereadblk(d, s, n)  eeprom_read_block (d, s, n)
+
+#define haleeirq(on)        ((on) ? SETBIT (EECR, EERIE) : CLEARBIT (EECR, EERIE))
+
+static inline void halinit (void)
+/*!
+ @brief     Configures the output ports and the input pullups
+ */
+{
+  // Configure DDR. Make OUT and ST output ports
+  SETBIT (OUTDDR,  OUTPIN);
+  SETBIT (STDDR,   STPIN);
+
+  // Raise internal pullups for all inputs
+  SETBIT (KEYPORT, DITPIN);
+  SETBIT (KEYPORT, DAHPIN);
+  SETBIT (BTNPORT, BTNPIN);
+#if defined(SERIAL) || defined(TELEMETRY)
+  SETBIT (KEYPORT, RXPIN);
+#endif
+}
+
+static inline void haltimer (void)
+/*!
+ @brief     Starts the heartbeat and the pin change interrupts
+ */
+{
+#ifdef POWERSAVE
+    PCMSK |= PWRWAKE;      // Define which keys wake us up
+#endif
+    PCMSK |= EDGEPINS;     // and which edges are captured
+    PCMSK |= (1 << BTNPIN); // The button ends a slow heartbeat
+#ifdef SERIAL
+    PCMSK |= (1 << RXPIN); // including the serial input
+#endif
+    GIMSK |= (1 << PCIE);  // Enable pin change interrupt
+
+    // Initialize timer1 to serve as the system heartbeat. CK runs at 1
+    // MHz. Prescaling by 8 makes that 125 kHz. Counting 125 cycles of
+    // that generates an overflow every 1.0 ms
+
+    OCR1C = BEATCNT-1; // 125 counts per cycle
+    TCCR1 |= (1 << CTC1) | 0b00000100; // Clear Timer on match, prescale ck by 8
+    OCR1A = 1; // CTC mode does not create an overflow so we use OCR1A
+    TIMSK |= (1 << OCIE1A); // which then interrupts every 1.0 ms
+
+    // Nothing uses the analog comparator, the ADC or the USI. Stopping
+    // them reduces the current drawn in idle sleep between beats.
+    ACSR |= (1 << ACD);
+    PRR  |= (1 << PRADC) | (1 << PRUSI);
+
+    sei ();
+}
+
+static inline uint8_t halsubbeat (void)
+/*!
+ @brief     Timer1 counts since the last heartbeat
+
+ The compare match, and so the heartbeat, happens at count 1. If the
+ heartbeat interrupt is pending the count belongs to the next beat.
+ */
+{
+  uint8_t t = TCNT1;
+
+  t = t ? t - 1 : BEATCNT - 1;
+  if ((TIFR & (1 << OCF1A)) && t < BEATCNT/2) t += BEATCNT;
+  return t;
+}
+
+static inline void halbeatslow (void)
+/*!
+ @brief     Stretches the heartbeat to 2^SLOWBEAT ms, from now on
+
+ The prescaler is raised from 8 to 8 << SLOWBEAT and the cycle
+ restarts, so the next compare match comes one slow beat later.
+ Interrupts must be disabled.
+ */
+{
+  TCCR1 = (TCCR1 & 0xf0) | (0b0100 + SLOWBEAT);
+  GTCCR |= (1 << PSR1);
+  TCNT1 = 1;
+}
+
+static inline uint16_t halbeatfast (void)
+/*!
+ @brief     Returns to the 1 ms heartbeat, with a beat right away
+
+ The timer continues two counts before the compare match, so that the
+ next heartbeat comes 16 us from now, and 1 ms apart after that.
+ Writing TCNT1 blocks a match in the next count only. Interrupts must
+ be disabled.
+
+ @return    Time since the last slow heartbeat, in 1 ms timer1 counts
+ */
+{
+  uint16_t t = TCNT1;
+
+  t = t ? t - 1 : BEATCNT - 1;
+  if ((TIFR & (1 << OCF1A)) && t < BEATCNT/2) {
+    t += BEATCNT;             // Its interrupt is pending, take it here
+    TIFR = (1 << OCF1A);
+  }
+  TCCR1 = (TCCR1 & 0xf0) | 0b0100;
+  GTCCR |= (1 << PSR1);
+  TCNT1 = BEATCNT - 1;
+  return t << SLOWBEAT;
+}
+
+static inline void halserout (uint8_t level)
+/*!
+ @brief     Drives the serial line, shared with the serial input
+
+ A one releases the line to the pullup, a zero pulls it low.
+ */
+{
+  if (level) {
+    CLEARBIT (KEYDDR, RXPIN);
+    SETBIT (KEYPORT, RXPIN);
+  } else {
+    CLEARBIT (KEYPORT, RXPIN);
+    SETBIT (KEYDDR, RXPIN);
+  }
+}
+
+static inline void halbitstart (void)
+/*!
+ @brief     Starts the bit clock, compare B of timer1, a few counts ahead
+
+ Interrupts must be disabled.
+ */
+{
+  uint8_t c = TCNT1 + 4;
+
+  OCR1B = (c < BEATCNT) ? c : c - BEATCNT;
+  TIFR  = (1 << OCF1B);
+  TIMSK |= (1 << OCIE1B);
+}
+
+static inline void halbitnext (void)
+/*!
+ @brief     Moves the bit clock BITCNT counts on from its last match
+
+ Called from the compare B interrupt. A bit is shorter than the
+ BEATCNT counts timer1 takes to wrap around, so the new value is
+ reached once, BITCNT counts after the previous match.
+ */
+{
+  uint8_t c = OCR1B + BITCNT;
+
+  OCR1B = (c < BEATCNT) ? c : c - BEATCNT;
+}
+
+#define halbitstop()        CLEARBIT (TIMSK, OCIE1B)
+
+#define halbeatlate()       (TIFR & (1 << OCF1A)) // Next heartbeat pending
+
+static inline void haleestart (uint8_t *p, uint8_t v)
+/*!
+ @brief     Starts writing a byte to EEPROM (erase and write, 3.4 ms)
+
+ The previous write must be complete, as it is when the EEPROM ready
+ interrupt is called. Interrupts must be disabled.
+ */
+{
+  EEAR = (uint16_t) p;
+  EEDR = v;
+  EECR |= (1 << EEMPE);   // Master write enable, EEPE within 4 cycles
+  EECR |= (1 << EEPE);
+}
+
+static inline void halidle (void)
+/*!
+ @brief     Sleeps until the next interrupt
+
+ Must be called with interrupts disabled, which is also the state on
+ return. As the instruction following sei is always executed, an
+ interrupt cannot slip in between and leave us sleeping.
+ */
+{
+  set_sleep_mode (SLEEP_MODE_IDLE);
+  sleep_enable ();
+  sei ();
+  sleep_cpu ();
+  sleep_disable ();
+  cli ();
+}
+
+static inline void haltoneon (uint16_t ctc)
+/*!
+ @brief     Starts the sidetone generator (timer0 in CTC mode)
+ */
+{
+  OCR0A = ctc;    // Then switch on the Sidetone generator
+  OCR0B = ctc;
+
+  // Activate CTC mode
+  TCCR0A |= (1 << COM0B0 | 1 << WGM01);
+
+  // Configure prescaler
+  TCCR0B = 1 << CS01;
+}
+
+static inline void haltoneoff (void)
+/*!
+ @brief     Stops the sidetone generator
+ */
+{
+  TCCR0A = 0;
+  TCCR0B = 0;
+}
+
+#ifdef STACKCHECK
+extern uint8_t _end;      // End of the static data, from the linker
+extern uint8_t __stack;   // Top of RAM, where the stack starts
+
+static inline uint16_t halstackfree (void)
+/*!
+ @brief     Bytes above the static data that the stack never reached
+
+ Counts the bytes still holding STACKPAINT from the end of the static
+ data up, see HALSTACKPAINT.
+ */
+{
+  const uint8_t *p = &_end;
+
+  while (p <= &__stack && *p == STACKPAINT) p++;
+  return p - &_end;
+}
+#endif
+
+static inline void halpowerdown (uint16_t ms)
+/*!
+ @brief     Powers down until a pin change or the watchdog wakes us up
+
+ The watchdog runs in interrupt mode, from its own 128 kHz oscillator,
+ and only while powered down. Must be called with interrupts disabled,
+ which is also the state on return, see halidle.
+
+ @param ms  Watchdog period, 16 ms times a power of two up to 8192 ms,
+            0 to leave it off
+ */
+{
+  uint8_t p = 0;          // WDP, the period is 2048 << p cycles
+
+  if (ms) {
+    while (ms > 16) {
+      ms >>= 1;
+      p++;
+    }
+    wdt_reset ();
+    WDTCR = (1 << WDCE) | (1 << WDE); // Timed sequence, 4 cycles
+    WDTCR = (1 << WDIE) | ((p & 8) << 2) | (p & 7);
+  }
+  set_sleep_mode (SLEEP_MODE_PWR_DOWN);
+  sleep_bod_disable ();
+  sleep_enable ();
+  sei ();
+  sleep_cpu ();
+  sleep_disable ();
+  cli ();
+  if (ms) {               // Stop it, a pin change may have woken us
+    WDTCR = (1 << WDCE) | (1 << WDE);
+    WDTCR = 0;
+  }
+}
+
+#else
+
+// ***************************************************************************
+// Host backend, implemented in yackhost.c
+// ***************************************************************************
+
+#include <stdio.h>
+
+#define HALISR(vector)      void vector (void)
+#define HALSTACKPAINT                   // No stack to measure
+#define halstackfree()      0
+
+#define PROGMEM
+#define EEMEM
+
+#define PCINT2  2         // Pin change mask bits, as on the ATtiny
+#define PCINT3  3
+#define PCINT4  4
+
+// Interrupts only occur within the hal calls, so a block of plain code
+// is atomic already
+#define ATOMIC_BLOCK(type)
+
+void PCINT0_vect (void);
+void TIMER1_COMPA_vect (void);
+void TIMER1_COMPB_vect (void);
+void EE_RDY_vect (void);
+void WDT_vect (void);
+
+uint8_t halkeys (void);
+uint8_t halbutton (void);
+void    haloutset (void);
+void    haloutclr (void);
+void    haldelay (uint16_t ms);
+void    halinit (void);
+void    haltimer (void);
+uint8_t halsubbeat (void);
+void    halbeatslow (void);
+uint16_t halbeatfast (void);
+uint8_t halbeatlate (void);
+void    halidle (void);
+void    haltoneon (uint16_t ctc);
+void    haltoneoff (void);
+void    halpowerdown (uint16_t ms);
+void    halserout (uint8_t level);
+void    halbitstart (void);
+void    halbitnext (void);
+void    halbitstop (void);
+
+#define halpgmbyte(p)       (*(const uint8_t *)(p))
+#define halpgmptr(p)        (*(p))
+
+#define haleeread(p)        (*(p))
+#define haleereadw(p)       (*(p))
+void    haleereadblk (void *dst, const void *src, uint16_t n);
+void    haleeirq (uint8_t on);
+void    haleestart (uint8_t *p, uint8_t v);
+
+// Simulator control, not part of the abstraction
+void     hostopen (FILE *f);
+void     hostquiet (void);
+uint32_t hostms (void);
+void     hostmark (void);
+uint32_t hostspan (void);
+
+#endif
+
+#endif // YACKHAL_H
@@ -0,0 +1,598 @@
+/*!
+
+ @file      yackhost.c
+ @brief     Host backend of the keyer hardware abstraction layer
+ @author    Anders Helmersson, SM5KAE
+
+ This file implements the primitives declared in yackhal.h for a native
+ build (-DHOST). The ATtiny is replaced by a simulated port, an EEPROM
+ image in RAM and a clock counting microseconds. The clock only
+ advances when the keyer waits for it: every heartbeat, delay and port
+ read moves it forward, so the keyer runs as fast as the host allows.
+ Interrupts are simulated too: the heartbeat interrupt is called at
+ every ms boundary the clock passes, or every slow beat while the
+ heartbeat is slowed down, and the pin change interrupt when the
+ script changes a wake-up contact. The EEPROM ready interrupt is
+ called, while enabled, once EEWRITEUS have passed since the last write
+ was started. Like on the chip, interrupts do not nest and a pending
+ interrupt is dropped if it recurs before it was serviced. The compare
+ B interrupt, which clocks the telemetry bits, is called at the time
+ it is due. In power down the watchdog interrupt, when enabled, comes
+ after exactly its nominal period.
+
+ Paddle and button activity is read from a stimulus script. Each line
+ holds a time in ms followed by the contacts that are closed from that
+ moment on:
+
+   .   Dit contact
+   -   Dah contact
+   c   Command button
+   _   Nothing closed
+
+ for example "1000 ." followed by "1200 _" holds the dit paddle for
+ 200 ms. A line "<ms> ser <text>" sends the text to the serial input,
+ 8N1 at BAUD starting at that time and without pauses between the
+ characters. The next line must come after the text is sent. A line
+ "<ms> end" terminates the simulation at that time.
+ Empty lines and lines starting with # are ignored. Without an end line
+ the simulation stops HOSTTAIL ms after the last stimulus.
+
+ Every change of the TX line and the sidetone is printed on stdout
+ together with the time it happened and the duration of the previous
+ state, all in ms. The telemetry output is received like a UART at
+ BAUD would, and each line printed with the time it was complete.
+
+ Without a script the simulation runs until the caller stops it and
+ nothing is printed. hostmark and hostspan then measure the keying.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ @date      2025-03-01  - Created
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "yack.h"
+#include "yackhal.h"
+
+#define POLLUS       10  // Simulated time spent reading a port (us)
+#define HOSTTAIL  60000  // Run this long after the last stimulus (ms)
+#define EEWRITEUS  3400  // Duration of an EEPROM byte write (us)
+
+static uint32_t hostus;           // Simulated time in us
+static byte     pins = 0xff;      // Input port, contacts open (pulled up)
+static byte     drive = 0xff;     // Pins pulled low by the serial output
+
+static byte     timeron = FALSE;  // Heartbeat interrupt enabled
+static byte     pcmask = 0;       // Pins enabled for pin change interrupt
+static byte     asleep = FALSE;   // Powered down, timer stopped
+static byte     inisr = FALSE;    // An interrupt routine is running
+static byte     beatirq = FALSE;  // Heartbeat interrupt pending
+static uint32_t beatdue = 0;      // Time it became pending
+static uint32_t beatus = 0;       // Time of the last heartbeat
+static uint32_t beatnext = 1000;  // Time of the next compare match
+static uint32_t beatlen = 1000;   // Time between compare matches
+static byte     woken;            // An interrupt routine ran in halidle
+static byte     pcirq = FALSE;    // Pin change interrupt pending
+static byte     wdtirq = FALSE;   // Watchdog interrupt pending
+static byte     eeirqon = FALSE;  // EEPROM ready interrupt enabled
+static uint32_t eeready = 0;      // Time the EEPROM write completes (us)
+static byte     bitirqon = FALSE; // Compare B interrupt enabled
+static uint32_t bitdue;           // Time of its next match (us)
+
+static FILE    *script;           // Stimulus input
+static uint32_t nextus;           // Time of the next stimulus
+static byte     nextpins;         // Port state at that time
+static byte     linepins = 0xff;  // Contacts of the last script line
+static byte     pending = FALSE;  // TRUE if nextus/nextpins are valid
+static uint32_t endms = 0;        // Time at which the simulation ends
+
+static byte     txlevel = 0;      // Level of the TX key line
+static uint32_t txsince = 0;      // Time of the last TX line change
+static uint16_t tonectc = 0;      // Sidetone CTC value, 0 if silent
+static uint32_t tonesince = 0;    // Time of the last sidetone change
+
+static char     sertext[80];      // Text for the serial input
+static byte     serpos;           // Character being sent
+static byte     serbit;           // and its bit, 0 is the start bit
+static uint32_t serus;            // Time its start bit begins
+static byte     serlevel = 1;     // Level of the serial input
+
+static char     telline[80];      // Telemetry line being received
+static byte     tellen = 0;       // and its length
+static uint32_t telstart;         // Start bit of the frame received (us)
+static byte     telbit = 10;      // Next bit to sample, 10 between frames
+static byte     teldata;          // Data bits so far
+static byte     tellevel = 1;     // Level of the serial output
+
+static byte     quiet = FALSE;    // No script, do not print
+static uint32_t firstdown;        // First key down since hostmark (us)
+static uint32_t lastdown;         // Last key down since hostmark (us)
+static byte     marked = FALSE;   // No key down since hostmark yet
+
+static byte hostserial (void)
+/*!
+ @brief     Makes the next level change of the serial input the stimulus
+
+ @return    FALSE if the text has been sent
+ */
+{
+  while (sertext[serpos]) {
+    byte c = sertext[serpos];
+    byte level = (serbit == 0) ? 0 : (serbit < 9) ? (c >> (serbit - 1)) & 1 : 1;
+    uint32_t t = serus + serbit * 1000000UL / BAUD;
+
+    if (++serbit == 10) {
+      serbit = 0;
+      serpos++;
+      serus += 10 * 1000000UL / BAUD;
+    }
+    if (level != serlevel) {
+      serlevel = level;
+      nextus   = t;
+      nextpins = serlevel ? linepins : linepins & ~(1 << RXPIN);
+      pending  = TRUE;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static void hostread (void)
+/*!
+ @brief     Reads the next stimulus line from the script
+ */
+{
+  char line[120];
+  char what[40];
+  unsigned long ms;
+  int n;
+
+  pending = FALSE;
+  if (hostserial ()) return;
+
+  while (script && fgets (line, sizeof (line), script)) {
+    if (line[0] == '#' || sscanf (line, "%lu %39s%n", &ms, what, &n) != 2)
+      continue;
+
+    if (strcmp (what, "end") == 0) {
+      endms = ms;
+      return;
+    }
+
+    endms = ms + HOSTTAIL;
+    if (strcmp (what, "ser") == 0) {
+      sscanf (line + n, " %79[^\n]", sertext);
+      serpos = serbit = 0;
+      serus  = (uint32_t) ms * 1000;
+      if (hostserial ()) return;
+      continue;
+    }
+
+    linepins = 0xff;
+    for (char *p = what; *p; p++) {
+      switch (*p) {
+        case '.': linepins &= ~(1 << DITPIN); break;
+        case '-': linepins &= ~(1 << DAHPIN); break;
+        case 'c': linepins &= ~(1 << BTNPIN); break;
+      }
+    }
+    nextus   = (uint32_t) ms * 1000;
+    nextpins = linepins;
+    pending  = TRUE;
+    return;
+  }
+}
+
+static void hostexit (void)
+/*!
+ @brief     Terminates the simulation
+ */
+{
+  printf ("%8lu end\n", (unsigned long) (hostus / 1000));
+  exit (0);
+}
+
+static void hostirq (void)
+/*!
+ @brief     Runs pending interrupt routines, in vector order
+ */
+{
+  if (inisr) return;
+
+  inisr = TRUE;
+  woken = TRUE;
+  while (pcirq || beatirq || (eeirqon && hostus >= eeready)
+         || (bitirqon && hostus >= bitdue) || wdtirq) {
+    if (pcirq) {
+      pcirq = FALSE;
+      PCINT0_vect ();
+    } else if (beatirq) {
+      beatirq = FALSE;
+      beatus  = beatdue;
+      TIMER1_COMPA_vect ();
+    } else if (eeirqon && hostus >= eeready) {
+      EE_RDY_vect ();
+    } else if (bitirqon && hostus >= bitdue) {
+      TIMER1_COMPB_vect ();
+    } else {
+      wdtirq = FALSE;
+      WDT_vect ();
+    }
+  }
+  inisr = FALSE;
+}
+
+static void hostapply (uint32_t until)
+/*!
+ @brief     Applies the stimulus lines up to a point in time
+ */
+{
+  while (pending && nextus <= until) {
+    if (nextus > hostus) hostus = nextus;
+    if ((pins ^ nextpins) & drive & pcmask) pcirq = TRUE;
+    pins = nextpins;
+    hostread ();
+    hostirq ();
+  }
+}
+
+static void hostadvance (uint32_t us)
+/*!
+ @brief     Moves the simulated clock forward
+
+ Stimulus lines falling into the interval are applied to the port and
+ the interrupts due are run.
+
+ @param us  Number of microseconds to advance
+ */
+{
+  uint32_t target = hostus + us;
+  uint32_t next;
+
+  if (asleep) {           // Timer1 stands still in power down
+    beatus   += us;
+    beatnext += us;
+  }
+
+  // Interrupt routines read the port too, which moves the clock
+  // further. Time never goes backwards. Compare B matches between the
+  // heartbeats are stepped to as well.
+
+  while (TRUE) {
+    next = beatnext;
+    if (bitirqon && bitdue > hostus && bitdue < next) next = bitdue;
+    if (next > target) break;
+
+    hostapply (next);
+    if (hostus < next) hostus = next;
+
+    // An interrupt routine run by hostapply may have passed the
+    // heartbeat already and raised it
+    if (next == beatnext) {
+      beatnext += beatlen;
+      if (timeron && !asleep) {
+        beatirq = TRUE;
+        beatdue = next;
+      }
+    }
+    hostirq ();
+  }
+  hostapply (target);
+  if (hostus < target) hostus = target;
+
+  if (!pending && !quiet && hostus >= endms * 1000) hostexit ();
+}
+
+void hostopen (FILE *f)
+/*!
+ @brief     Selects the stimulus script and resets the clock
+
+ @param f   Script file, NULL to run quietly without stimuli
+ */
+{
+  script = f;
+  quiet  = (f == NULL);
+  hostus = 0;
+  beatnext = beatlen = 1000;
+  pins   = 0xff;
+  hostread ();
+}
+
+void hostquiet (void)
+/*!
+ @brief     Stops printing for a script the caller runs and ends itself
+ */
+{
+  quiet = TRUE;
+}
+
+void hostmark (void)
+/*!
+ @brief     Starts a keying measurement
+ */
+{
+  marked = TRUE;
+}
+
+uint32_t hostspan (void)
+/*!
+ @brief     Time from the first to the last key down since hostmark, in us
+ */
+{
+  return marked ? 0 : lastdown - firstdown;
+}
+
+static void hostdown (void)
+/*!
+ @brief     Records a key down for hostspan
+ */
+{
+  if (marked) {
+    marked = FALSE;
+    firstdown = hostus;
+  }
+  lastdown = hostus;
+}
+
+uint32_t hostms (void)
+/*!
+ @brief     Simulated time in ms
+ */
+{
+  return hostus / 1000;
+}
+
+static void hostlog (const char *what, uint32_t since)
+/*!
+ @brief     Prints an output change with the length of the previous state
+ */
+{
+  uint32_t now = hostus / 1000;
+
+  if (quiet) return;
+  printf ("%8lu %-10s %6lu\n", (unsigned long) now, what,
+          (unsigned long) (now - since));
+}
+
+void halinit (void)
+{
+  pins    = 0xff;
+  txlevel = 0;
+  tonectc = 0;
+}
+
+void haltimer (void)
+{
+#ifdef POWERSAVE
+  pcmask  = PWRWAKE;
+#endif
+  pcmask |= EDGEPINS;
+  pcmask |= (1 << BTNPIN);
+#ifdef SERIAL
+  pcmask |= (1 << RXPIN);
+#endif
+  timeron = TRUE;
+}
+
+byte halsubbeat (void)
+/*!
+ @brief     Timer1 counts since the last heartbeat
+
+ Also at a ms boundary whose heartbeat has not run yet, as when a
+ stimulus falls on it, the counts belong to the previous heartbeat.
+ */
+{
+  uint32_t t = (hostus - beatus) * BEATCNT / 1000;
+
+  return (t > MAX_BYTE) ? MAX_BYTE : t;
+}
+
+uint8_t halbeatlate (void)
+{
+  return beatirq || hostus >= beatnext;
+}
+
+void halbeatslow (void)
+{
+  beatus   = hostus;
+  beatlen  = 1000 << SLOWBEAT;
+  beatnext = hostus + beatlen;
+}
+
+uint16_t halbeatfast (void)
+{
+  uint32_t t = (hostus - beatus) * BEATCNT / 1000;
+
+  if (beatirq) {                  // Pending, taken here
+    beatirq = FALSE;
+    t = (hostus - beatdue) * BEATCNT / 1000 + (BEATCNT << SLOWBEAT);
+  }
+  beatlen  = 1000;
+  beatnext = hostus + 2 * 1000 / BEATCNT;
+  beatus   = beatnext - beatlen;
+  return t;
+}
+
+byte halkeys (void)
+{
+  hostadvance (POLLUS);
+  return pins & drive;
+}
+
+byte halbutton (void)
+/*!
+ @brief     Reads the button, in no time as it is polled every heartbeat
+ */
+{
+  return pins & drive;
+}
+
+void haloutset (void)
+{
+  if (!txlevel) {
+    hostlog ("tx high", txsince);
+    txsince = hostus / 1000;
+  }
+  txlevel = 1;
+}
+
+void haloutclr (void)
+{
+  if (txlevel) {
+    hostlog ("tx low", txsince);
+    txsince = hostus / 1000;
+  }
+  txlevel = 0;
+}
+
+void haldelay (uint16_t ms)
+{
+  hostadvance ((uint32_t) ms * 1000);
+}
+
+void halidle (void)
+/*!
+ @brief     Waits for the next interrupt, at the latest the next beat
+ */
+{
+  uint32_t until = beatnext;
+  uint32_t step;
+
+  woken = FALSE;
+  while (!woken && hostus < until) {
+    step = until;
+    if (pending && nextus > hostus && nextus < step) step = nextus;
+    if (eeirqon && eeready > hostus && eeready < step) step = eeready;
+    if (bitirqon && bitdue > hostus && bitdue < step) step = bitdue;
+    if (!pending && endms * 1000 > hostus && endms * 1000 < step)
+      step = endms * 1000;
+    hostadvance (step - hostus);
+  }
+}
+
+void haltoneon (uint16_t ctc)
+{
+  if (!tonectc) {
+    hostdown ();
+    char what[16];
+    snprintf (what, sizeof (what), "st %luHz",
+              (unsigned long) (F_CPU / 2 / 8 / (ctc + 1)));
+    hostlog (what, tonesince);
+    tonesince = hostus / 1000;
+  }
+  tonectc = ctc;
+}
+
+void haltoneoff (void)
+{
+  if (tonectc) {
+    hostlog ("st off", tonesince);
+    tonesince = hostus / 1000;
+  }
+  tonectc = 0;
+}
+
+void halpowerdown (uint16_t ms)
+/*!
+ @brief     Sleeps until the next contact change or watchdog interrupt,
+            or ends the simulation
+ */
+{
+  uint32_t wdt = hostus + ms * 1000UL;
+
+  asleep = TRUE;
+  while (pending && !((nextpins ^ pins) & pcmask) && !(ms && nextus >= wdt))
+    hostadvance (nextus - hostus);
+
+  if (!pending && quiet) {
+    asleep = FALSE;       // Nothing could wake us, carry on
+    return;
+  }
+  if (ms && !(pending && nextus < wdt)) {
+    hostadvance (wdt - hostus);    // Ends the simulation when it is over
+    wdtirq = TRUE;
+    hostirq ();
+  } else {
+    if (!pending) hostexit ();
+    hostadvance (nextus - hostus); // Wakes through the pin change
+  }
+  asleep = FALSE;
+}
+
+static void hosttel (byte level)
+/*!
+ @brief     Receives the serial output, sampling each bit in its middle
+
+ @param level   Level of the line from now on
+ */
+{
+  while (telbit < 10 && hostus >= telstart + (telbit * 2 + 1) * 500000UL / BAUD) {
+    if (telbit == 0 && tellevel) {
+      telbit = 9;                     // Not a start bit
+    } else if (telbit > 0 && telbit < 9) {
+      teldata = (teldata >> 1) | (tellevel << 7);
+    } else if (telbit == 9 && !tellevel) {
+      if (!quiet) printf ("%8lu tel framing error\n", (unsigned long) (hostus / 1000));
+    } else if (telbit == 9 && teldata == '\n') {
+      telline[tellen] = 0;
+      if (!quiet) printf ("%8lu tel %s\n", (unsigned long) (hostus / 1000), telline);
+      tellen = 0;
+    } else if (telbit == 9 && tellen < sizeof (telline) - 1) {
+      telline[tellen++] = teldata;
+    }
+    telbit++;
+  }
+  if (telbit == 10 && tellevel && !level) {
+    telstart = hostus;
+    telbit = 0;
+  }
+  tellevel = level;
+}
+
+void halserout (byte level)
+{
+  byte was = drive;
+
+  drive = level ? 0xff : (byte) ~(1 << RXPIN);
+  if ((was ^ drive) & pins & pcmask) pcirq = TRUE;
+  hosttel (level);
+}
+
+void halbitstart (void)
+{
+  bitdue = hostus + 4 * 1000 / BEATCNT;
+  bitirqon = TRUE;
+}
+
+void halbitnext (void)
+{
+  bitdue += BITCNT * 1000 / BEATCNT;
+}
+
+void halbitstop (void)
+{
+  bitirqon = FALSE;
+  hosttel (tellevel);               // The stop bit ends now
+}
+
+void haleereadblk (void *dst, const void *src, uint16_t n)
+{
+  memcpy (dst, src, n);
+}
+
+void haleeirq (byte on)
+{
+  eeirqon = on;
+}
+
+void haleestart (byte *p, byte v)
+{
+  *p = v;
+  eeready = hostus + EEWRITEUS;
+}
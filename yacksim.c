@@ -0,0 +1,457 @@
+/*!
+
+ @file      yacksim.c
+ @brief     Native simulator of the CW keyer
+ @author    Anders Helmersson, SM5KAE
+
+ Runs the keyer application (main.c) on the host against the simulated
+ hardware of yackhost.c. The firmware main() is renamed to yackmain()
+ when compiled for the host, see the Makefile.
+
+ Usage: yacksim [script]
+        yacksim -p [farnsworth]
+        yacksim -c
+        yacksim -b
+        yacksim -j [jitter]
+
+ The stimulus script (default stdin) describes the paddle and button
+ activity, see yackhost.c for the format. The TX line and sidetone
+ changes are printed on stdout with ms timestamps.
+
+ With -p the keyer library is driven directly instead. PARIS is sent
+ at every speed from MINWPM to MAXWPM, optionally with a Farnsworth
+ speed, and the timing error against the nominal word rate is printed.
+ The exit status is 1 if any error reaches PARISTOL.
+
+ With -c a set of sample contest and QSO macros is stored as messages
+ and the bits each takes are compared to one byte per character and a
+ terminator, the format used before the messages were packed.
+
+ With -b yackelements is checked against the loop it replaced for all
+ character codes and both are timed on the sample macros. Build with
+ CFLAGS="-I. -DNFIB=24" for the word sized codes.
+
+ With -j the sample macros are keyed by operators whose dits and gaps
+ are off the keyer speed, with jitter in percent (default JITPCT), on
+ the straight key and the paddle. The decoding errors are printed with
+ the nominal timing and with the timing learned from the operator.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ @date      2025-03-01  - Created
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc ()
+#else
+#define CYCLES() 0
+#endif
+#include "yack.h"
+#include "yackhal.h"
+
+#define PARISN    10     // Words per measurement
+#define PARISTOL  0.1    // Largest acceptable error (%)
+#define BENCHREPS 20000  // Passes over the samples per measurement
+#define JITWPM    15     // Keyer speed of the jitter test
+#define JITPCT    15     // Default jitter of the operator (%)
+#define JITSEED   1      // Start of the jitter sequence
+#define JITMAX    1000   // Characters of the sample text, at most
+
+int yackmain (void);
+
+static const byte paris[] = {C_P, C_A, C_R, C_I, C_S, C_SPACE, 0};
+static const byte parise[] = {C_E, 0};
+
+static const char *samples[] = {
+  "CQ TEST SM5KAE SM5KAE TEST",
+  "CQ CQ DE SM5KAE SM5KAE K",
+  "CQ DX DE SM5KAE SM5KAE PSE K",
+  "TU 5NN 14",
+  "5NN 14",
+  "R 5NN 14 TU",
+  "TU SM5KAE TEST",
+  "QRZ?",
+  "AGN?",
+  "SM5KAE",
+  "TNX FER QSO 73 GL",
+  "NAME ANDERS ANDERS QTH STOCKHOLM STOCKHOLM",
+  "UR RST 599 599",
+  "73 ES GL DE SM5KAE SK",
+  NULL};
+
+static int compression (void)
+/*!
+ @brief     Reports how densely the sample macros are stored
+
+ @return    Exit status, 1 if a sample did not fit
+ */
+{
+  byte buf[MACROSIZE];
+  unsigned long plain = 0;
+  unsigned long packed = 0;
+  word bits;
+  int n, i;
+
+  hostopen (NULL);
+  yackinit ();
+
+  printf ("chars  bytes   bits  ratio  text\n");
+  for (n = 0; samples[n]; n++) {
+    for (i = 0; samples[n][i]; i++)
+      buf[i] = yackascii (samples[n][i]);
+    buf[i] = 0;
+
+    if (!(bits = yackstore (1, buf))) {
+      fprintf (stderr, "%s does not fit\n", samples[n]);
+      return 1;
+    }
+    printf ("%5d %6d %6u %6.2f  %s\n", i, i + 1, bits,
+            (i + 1) * 8.0 / bits, samples[n]);
+    plain  += i + 1;
+    packed += bits;
+  }
+  printf ("%5s %6lu %6lu %6.2f  total\n", "", plain, packed,
+          plain * 8.0 / packed);
+  return 0;
+}
+
+static const word fib[24] = {1, 1, 2, 3, 5, 8, 13, 21, 34, 55, 89, 144,
+  233, 377, 610, 987, 1597, 2584, 4181, 6765, 10946, 17711, 28657, 46368};
+
+static word loopelements (byte c)
+/*!
+ @brief     Takes a character code apart, as done before the fibels table
+ */
+{
+  word e = 1;
+  byte n;
+
+  for (n = NFIB-2; n > 1; n--) {
+    if (c >= fib[n]) {
+      c -= fib[n-2];
+      e <<= 1;
+      if (c >= fib[n]) {
+        c -= fib[--n];
+        e |= 1;
+      }
+    }
+  }
+  return e;
+}
+
+static void bench (const char *name, word (*fn) (byte), const byte *text,
+                   int len)
+/*!
+ @brief     Times a translation from character codes to elements
+ */
+{
+  struct timespec t0, t1;
+  volatile word sink = 0;
+  unsigned long long c0, c1;
+  double chars = (double) BENCHREPS * len;
+  int r, i;
+
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  c0 = CYCLES ();
+  for (r = 0; r < BENCHREPS; r++)
+    for (i = 0; i < len; i++) sink += fn (text[i]);
+  c1 = CYCLES ();
+  clock_gettime (CLOCK_MONOTONIC, &t1);
+
+  printf ("%-6s %8.2f ns/char %8.2f cycles/char\n", name,
+          ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / chars,
+          (c1 - c0) / chars);
+}
+
+static int benchmark (void)
+/*!
+ @brief     Checks and times yackelements against the loop it replaced
+
+ @return    Exit status, 1 if they differ for any code
+ */
+{
+  byte text[1000];
+  int len = 0;
+  int n, i;
+
+  for (n = 0; n < 256; n++) {
+    if (yackelements (n) != loopelements (n)) {
+      fprintf (stderr, "code %d: table %04x, loop %04x\n", n,
+               yackelements (n), loopelements (n));
+      return 1;
+    }
+  }
+
+  for (n = 0; samples[n]; n++)
+    for (i = 0; samples[n][i]; i++) text[len++] = yackascii (samples[n][i]);
+
+  printf ("NFIB %d, %d characters, all 256 codes agree\n", NFIB, len);
+  bench ("loop", loopelements, text, len);
+  bench ("table", yackelements, text, len);
+  return 0;
+}
+
+static int timing (byte fw)
+/*!
+ @brief     Measures the PARIS timing at all speeds
+
+ The time from the first element of the first PARIS to the E sent
+ after PARISN words is PARISN words at the nominal rate.
+
+ @param fw  Farnsworth speed, 0 if off
+ @return    Exit status
+ */
+{
+  byte wpm = MINWPM;
+  int bad = 0;
+
+  hostopen (NULL);
+  yackinit ();
+  if (!yackfarns (fw)) {
+    fprintf (stderr, "Farnsworth speed out of range\n");
+    return 2;
+  }
+  while (yackwpm () > MINWPM) yackspeed (DOWN);
+  while (yackwpm () < MINWPM) yackspeed (UP);
+
+  printf ("  wpm   nominal ms  measured ms    error\n");
+  while (TRUE) {
+    double nominal = PARISN * 60000.0 / ((fw && fw < wpm) ? fw : wpm);
+    double measured, error;
+    byte n;
+
+    hostmark ();
+    for (n = 0; n < PARISN; n++) yackstring (paris);
+    yackstring (parise);
+    yackflush ();
+
+    measured = hostspan () / 1000.0;
+    error = 100.0 * (measured - nominal) / nominal;
+    printf ("%5u %12.1f %12.1f %+8.3f%%\n", wpm, nominal, measured, error);
+    if (error >= PARISTOL || error <= -PARISTOL) bad = 1;
+
+    if (wpm >= MAXWPM) break;
+    yackspeed (UP);
+    wpm++;
+  }
+  return bad;
+}
+
+typedef struct {
+  word   dit;    // Operator dit, in ms
+  double chr;    // Gap between characters, in operator dits
+  double wrd;    // Gap between words
+} OPERATOR;
+
+static const OPERATOR operators[] = {
+  {80, 3, 7}, {60, 3, 7}, {80, 2.3, 5.5}, {80, 2, 5}, {80, 4.5, 10},
+  {80, 5, 12}, {0, 0, 0}};
+
+static uint32_t jitstate;
+
+static unsigned long jitter (double ms, int pct)
+/*!
+ @brief     A length as the operator keys it, within pct percent
+
+ A fixed xorshift sequence, so that every run keys the same.
+ */
+{
+  jitstate ^= jitstate << 13;
+  jitstate ^= jitstate >> 17;
+  jitstate ^= jitstate << 5;
+  return ms * (1.0 + pct / 100.0 * ((jitstate % 20001) / 10000.0 - 1.0)) + 0.5;
+}
+
+static unsigned long keytext (FILE *f, const word *text, int n,
+                              const OPERATOR *op, byte paddle, int pct)
+/*!
+ @brief     Writes a script keying a text with the straight key or paddle
+
+ The straight key keys every mark and gap with the operator's jitter.
+ The paddle keyer times the elements itself, so there only the gaps
+ between characters and words are the operator's. Each run of equal
+ elements is pressed a quarter dit before its first element and
+ released in the middle of its last, on the dit paddle for dits and
+ the dah paddle for dahs, as in dit priority.
+
+ @return    Time of the last stimulus, in ms
+ */
+{
+  unsigned long u = 1200 / JITWPM;      // Keyer dit
+  unsigned long t = 2000;               // Operator time
+  unsigned long s, free = 0;            // Keyer time
+  byte el[16], m, k;
+  word e;
+  int i;
+
+  jitstate = JITSEED;
+  for (i = 0; i < n; i++) {
+    if (text[i] == C_SPACE) continue;
+    for (m = 0, e = yackelements (text[i]); e > 1 && m < 16; e >>= 1)
+      el[m++] = e & 1;
+
+    if (paddle) {
+      s = (t > free) ? t : free;        // The keyer sends its gap first
+      for (k = 0; k < m; k++) {
+        if (k == 0)
+          fprintf (f, "%lu %c\n", t, el[k] ? '-' : '.');
+        else if (el[k] != el[k-1])
+          fprintf (f, "%lu %c\n", s - u / 4, el[k] ? '-' : '.');
+        if (k + 1 == m || el[k+1] != el[k])
+          fprintf (f, "%lu _\n", s + u / 2);
+        s += (el[k] ? DAHLEN : DITLEN) * u;
+      }
+      t = s - IEGLEN * u;               // End of the last mark
+      free = s + ICGLEN * u;
+    } else {
+      for (k = 0; k < m; k++) {
+        fprintf (f, "%lu .\n", t);
+        t += jitter ((el[k] ? 3 : 1) * op->dit, pct);
+        fprintf (f, "%lu _\n", t);
+        if (k + 1 < m) t += jitter (op->dit, pct);
+      }
+    }
+    t += jitter ((i + 1 < n && text[i+1] == C_SPACE ? op->wrd : op->chr)
+                 * op->dit, pct);
+  }
+  return t;
+}
+
+static int distance (const word *a, int n, const word *b, int m)
+/*!
+ @brief     Characters inserted, dropped or changed from one text to another
+ */
+{
+  static int d[2][JITMAX + 1];
+  int i, j, x;
+
+  for (j = 0; j <= m; j++) d[0][j] = j;
+  for (i = 1; i <= n; i++) {
+    int *p = d[(i - 1) & 1], *q = d[i & 1];
+
+    q[0] = i;
+    for (j = 1; j <= m; j++) {
+      x = p[j-1] + (a[i-1] != b[j-1]);
+      if (p[j] + 1 < x) x = p[j] + 1;
+      if (q[j-1] + 1 < x) x = q[j-1] + 1;
+      q[j] = x;
+    }
+  }
+  return d[n & 1][m];
+}
+
+static int decode (FILE *f, unsigned long end, byte mode, byte learn,
+                   const word *text, int n)
+/*!
+ @brief     Runs a script through a decoder and counts the errors
+
+ Word spaces at the start and repeated ones are not counted.
+ */
+{
+  word got[JITMAX];
+  word c;
+  int m = 0;
+
+  rewind (f);
+  hostopen (f);
+  hostquiet ();
+  yackinit ();
+  yackmode (mode);
+  while (yackwpm () > JITWPM) yackspeed (DOWN);
+  while (yackwpm () < JITWPM) yackspeed (UP);
+  yackoplearn (learn);
+
+  while (hostms () < end + 3000) {
+    c = yackiambic (ON);
+    if (c && m < JITMAX && !(c == C_SPACE && (!m || got[m-1] == C_SPACE)))
+      got[m++] = c;
+    yackbeat ();
+  }
+  if (m && got[m-1] == C_SPACE) m--;
+  return distance (text, n, got, m);
+}
+
+static int jittertest (int pct)
+/*!
+ @brief     Counts decoding errors of operators keying off the ratios
+
+ The sample macros are keyed as one text by operators with other dit
+ lengths and gaps than the keyer speed, with pct percent jitter, and
+ decoded in the straight key mode and with the paddle. Each is run
+ with the nominal timing and with the timing learned.
+
+ @return    Exit status
+ */
+{
+  word text[JITMAX];
+  const OPERATOR *op;
+  int n = 0, k, i;
+
+  for (k = 0; samples[k]; k++) {
+    for (i = 0; samples[k][i] && n < JITMAX - 1; i++) {
+      word c = yackascii (samples[k][i]);
+
+      if (c && !(c == C_SPACE && (!n || text[n-1] == C_SPACE))) text[n++] = c;
+    }
+    if (n && text[n-1] != C_SPACE && n < JITMAX - 1) text[n++] = C_SPACE;
+  }
+  if (n && text[n-1] == C_SPACE) n--;
+
+  printf ("%d characters at %d WPM, %d%% jitter, errors nominal/learned\n",
+          n, JITWPM, pct);
+  printf ("dit ms  char gap  word gap   straight     paddle\n");
+  for (op = operators; op->dit; op++) {
+    FILE *sk = tmpfile ();
+    FILE *pd = tmpfile ();
+    unsigned long skend, pdend;
+
+    if (!sk || !pd) {
+      perror ("tmpfile");
+      return 2;
+    }
+    skend = keytext (sk, text, n, op, FALSE, pct);
+    pdend = keytext (pd, text, n, op, TRUE, pct);
+    printf ("%6u %9.1f %9.1f %6d/%-5d %5d/%d\n", op->dit, op->chr, op->wrd,
+            decode (sk, skend, STRAIGHT, FALSE, text, n),
+            decode (sk, skend, STRAIGHT, TRUE, text, n),
+            decode (pd, pdend, DITPR, FALSE, text, n),
+            decode (pd, pdend, DITPR, TRUE, text, n));
+    fclose (sk);
+    fclose (pd);
+  }
+  return 0;
+}
+
+int main (int argc, char *argv[])
+{
+  FILE *f = stdin;
+
+  if (argc > 1 && strcmp (argv[1], "-p") == 0)
+    return timing (argc > 2 ? atoi (argv[2]) : 0);
+
+  if (argc > 1 && strcmp (argv[1], "-c") == 0)
+    return compression ();
+
+  if (argc > 1 && strcmp (argv[1], "-b") == 0)
+    return benchmark ();
+
+  if (argc > 1 && strcmp (argv[1], "-j") == 0)
+    return jittertest (argc > 2 ? atoi (argv[2]) : JITPCT);
+
+  if (argc > 1 && !(f = fopen (argv[1], "r"))) {
+    perror (argv[1]);
+    return 1;
+  }
+
+  hostopen (f);
+  return yackmain ();
+}